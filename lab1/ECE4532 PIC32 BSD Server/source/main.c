@@ -34,7 +34,33 @@
 #define PC_SERVER_IP_ADDR "192.168.2.105"  // check ipconfig for IP address
 #define SYS_FREQ (80000000)
 
-void DelayMsec(unsigned int);
+// Core timer ticks per millisecond. The core timer runs at SYS_FREQ/2.
+#define TICKSPERMSEC (SYS_FREQ/2000)
+
+// Time each step of an LED animation lasts
+#define LEDSTEPMSEC 50
+
+// LED animation stepped from the main loop instead of waited out. Step i
+// lights the LEDs in pattern[i] for LEDSTEPMSEC. step is the step showing,
+// equal to steps once the animation is over, and stepAt the core timer
+// tick the next step is due at.
+struct ledAnimation
+{
+    const unsigned int *pattern;
+    int steps;
+    int step;
+    unsigned int stepAt;
+};
+
+// A new connection runs LED1 to LED3, a global reset flashes LED1 and a
+// transfer LED3
+const unsigned int ledConnect[3] = {BIT_0, BIT_1, BIT_2};
+const unsigned int ledReset[1] = {BIT_0};
+const unsigned int ledTransfer[1] = {BIT_2};
+
+void ledStart(struct ledAnimation *led, const unsigned int *pattern,
+        int steps);
+void ledStep(struct ledAnimation *led);
 
 int main()
 {
@@ -47,6 +73,7 @@ int main()
             struct 		sockaddr_in addr;
             int addrlen = 	sizeof(struct sockaddr_in);
             unsigned int 	sys_clk, pb_clk;
+            struct ledAnimation	led = {NULL, 0, 0, 0};
 
 // LED setup
             mPORTDSetPinsDigitalOut(BIT_0 | BIT_1 | BIT_2 );	// RD0, RD1 and RD2 as outputs
@@ -85,6 +112,7 @@ int main()
 
                 TCPIPProcess();
                 DHCPTask();
+                ledStep(&led);
 
                 ip.Val = TCPIPGetIPAddr();
                 if(curr_ip.Val != ip.Val)		// DHCP server change IP address?
@@ -98,15 +126,7 @@ int main()
                         {
                         tlen = 1296;			// send buffer size
                         setsockopt(StreamSock, SOL_SOCKET, SO_SNDBUF, (char*)&tlen, sizeof(int));
-                        mPORTDSetBits(BIT_0);   // LED1=1
-                        DelayMsec(50);
-                        mPORTDClearBits(BIT_0); // LED1=0
-                        mPORTDSetBits(BIT_1);   // LED2=1
-                        DelayMsec(50);
-                        mPORTDClearBits(BIT_1); // LED2=0
-                        mPORTDSetBits(BIT_2);   // LED3=1
-                        DelayMsec(50);
-                        mPORTDClearBits(BIT_2); // LED3=0
+                        ledStart(&led, ledConnect, 3);
                         }
                     }
                 else
@@ -115,14 +135,13 @@ int main()
                         rlen = recvfrom(StreamSock, rbfr, sizeof(rbfr), 0, NULL, NULL);
                         if(rlen > 0)
                             {
+                            mPORTDClearBits(BIT_0); // LED1=0
                             if (rbfr[0]==2)	// 02 start of message
 //                                mPORTDSetBits(BIT_0);	// LED1=1
                                 {
                                 if(rbfr[1]==71)	//G global reset
                                     {
-                                    mPORTDSetBits(BIT_0);   // LED1=1
-                                    DelayMsec(50);
-                                    mPORTDClearBits(BIT_0); // LED1=0
+                                    ledStart(&led, ledReset, 1);
                                     }
                                 }
 
@@ -137,10 +156,8 @@ int main()
                                 if (i<1296)
                                     goto lpdat;
                                 send(StreamSock, tbfr, tlen, 0 );
-                                DelayMsec(50);
-                                mPORTDClearBits(BIT_2);	// LED3=0
+                                ledStart(&led, ledTransfer, 1);
                                 }
-                                mPORTDClearBits(BIT_0); // LED1=0
                             }
 
                         else if(rlen < 0)
@@ -153,12 +170,31 @@ int main()
             }	// end while(1)
 }   // end
 
-// DelayMsec( )   software millisecond delay
-void DelayMsec(unsigned int msec)
+// ledStart( )   restarts led with pattern, cutting short any animation
+// still showing
+void ledStart(struct ledAnimation *led, const unsigned int *pattern,
+        int steps)
 {
-unsigned int tWait, tStart;
+    if(led->step < led->steps)
+        mPORTDClearBits(led->pattern[led->step]);
+    led->pattern=pattern;
+    led->steps=steps;
+    led->step=0;
+    led->stepAt=ReadCoreTimer()+LEDSTEPMSEC*TICKSPERMSEC;
+    mPORTDSetBits(pattern[0]);
+}
 
-    tWait=(SYS_FREQ/2000)*msec;
-    tStart=ReadCoreTimer();
-    while((ReadCoreTimer()-tStart)<tWait);
+// ledStep( )   moves led to its next step once the one showing is up and
+// clears the LEDs after the last. Returns at once otherwise.
+void ledStep(struct ledAnimation *led)
+{
+    if(led->step==led->steps || (int)(ReadCoreTimer()-led->stepAt)<0)
+        return;
+    mPORTDClearBits(led->pattern[led->step]);
+    led->step++;
+    if(led->step < led->steps)
+        {
+        mPORTDSetBits(led->pattern[led->step]);
+        led->stepAt+=LEDSTEPMSEC*TICKSPERMSEC;
+        }
 }
@@ -37,7 +37,33 @@
 
 #define tlen1 50
 
-void DelayMsec(unsigned int);
+// Core timer ticks per millisecond. The core timer runs at SYS_FREQ/2.
+#define TICKSPERMSEC (SYS_FREQ/2000)
+
+// Time each step of an LED animation lasts
+#define LEDSTEPMSEC 50
+
+// Time between the chunks of a transfer
+#define CHUNKMSEC 50
+
+// LED animation stepped from the main loop instead of waited out. Step i
+// lights the LEDs in pattern[i] for LEDSTEPMSEC. step is the step showing,
+// equal to steps once the animation is over, and stepAt the core timer
+// tick the next step is due at.
+struct ledAnimation {
+    const unsigned int *pattern;
+    int steps;
+    int step;
+    unsigned int stepAt;
+};
+
+// A new connection runs LED1 to LED3 and a global reset flashes LED1
+const unsigned int ledConnect[3] = {BIT_0, BIT_1, BIT_2};
+const unsigned int ledReset[1] = {BIT_0};
+
+void ledStart(struct ledAnimation *led, const unsigned int *pattern, 
+    int steps);
+void ledStep(struct ledAnimation *led);
 
 int main() {
     // Initialize Sockets and IP address containers
@@ -48,6 +74,10 @@ int main() {
     // Initialize buffer length variables
     //
     int rlen, sent, bytesSent;
+
+    // Core timer tick the next chunk of a transfer is due at
+    //
+    unsigned int chunkAt = 0;
     
     // Initialize the Send/Recv buffers
     //
@@ -62,6 +92,10 @@ int main() {
     //
     unsigned int sys_clk, pb_clk;
 
+    // LED animation the loop steps
+    //
+    struct ledAnimation led = {NULL, 0, 0, 0};
+
     // Initialize LED Variables:
     // Setup the LEDs on the PIC32 board
     // RD0, RD1 and RD2 as outputs
@@ -141,6 +175,10 @@ int main() {
     
     char tbfr1[tlen1+1];
 
+    // No transfer running until a client asks for one
+    //
+    bytesSent = tlen;
+
     // Loop forever
     //
     while(1) {
@@ -148,6 +186,7 @@ int main() {
         //
         TCPIPProcess();
         DHCPTask();
+        ledStep(&led);
 
         // Get the machines IP address and save to variable
         //
@@ -169,18 +208,28 @@ int main() {
             if(clientSock != INVALID_SOCKET) {
                 setsockopt(clientSock, SOL_SOCKET, TCP_NODELAY, 
                     (char*)&tlen, sizeof(int));
-                mPORTDSetBits(BIT_0);   // LED1=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_0); // LED1=0
-                mPORTDSetBits(BIT_1);   // LED2=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_1); // LED2=0
-                mPORTDSetBits(BIT_2);   // LED3=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_2); // LED3=0
+                ledStart(&led, ledConnect, 3);
             }
         }
         else {
+            // Send the next chunk of a running transfer once it is due.
+            // The loop goes on serving the stack in between.
+            //
+            if(bytesSent < tlen && (int)(ReadCoreTimer() - chunkAt) >= 0){
+                memcpy(tbfr1, myStr+bytesSent, tlen1);
+                if (bytesSent > 1049){
+                    tbfr1[tlen-bytesSent+1] = '\0';
+                    send(clientSock, tbfr1, tlen-bytesSent+1, 0);
+                }
+                else{
+                    tbfr1[tlen1] = '\0';
+                    send(clientSock, tbfr1, tlen1+1, 0);
+                }
+                bytesSent += tlen1;
+                chunkAt += CHUNKMSEC*TICKSPERMSEC;
+                if(bytesSent >= tlen) mPORTDClearBits(BIT_2);	// LED3=0
+            }
+
             // We are connected to a client already. We start
             // by receiving the message being sent by the client
             //
@@ -190,6 +239,8 @@ int main() {
             // Check to see if socket is still alive
             //
             if(rlen > 0) {
+                mPORTDClearBits(BIT_0); // LED1=0
+
                 // If the received message first byte is '02' it signifies
                 // a start of message
                 //
@@ -200,36 +251,20 @@ int main() {
                     // '0271' to see if the message is a a global reset
                     //
                     if(rbfr[1]==71) {
-                        mPORTDSetBits(BIT_0);   // LED1=1
-                        DelayMsec(50);
-                        mPORTDClearBits(BIT_0); // LED1=0
+                        ledStart(&led, ledReset, 1);
                     }
                 }
                 // If the received message starts with a second byte is
                 // '84' it signifies a initiate transfer
                 //
+                // The chunks go out from the top of the loop, the first
+                // one on the next pass
+                //
                 if(rbfr[1]==84){
                     mPORTDSetBits(BIT_2);   // LED3=1
                     bytesSent = 0;
-                    //sent = 0;
-                    while (bytesSent < tlen){
-                        memcpy(tbfr1, myStr+bytesSent, tlen1);
-                        if (bytesSent > 1049){
-                            tbfr1[tlen-bytesSent+1] = '\0';
-                            send(clientSock, tbfr1, tlen-bytesSent+1, 0);
-                        }
-                        else{
-                            tbfr1[tlen1] = '\0';
-                            // Loop until we send the full message
-                            //
-                            send(clientSock, tbfr1, tlen1+1, 0);
-                        }
-                        bytesSent += tlen1;
-                        DelayMsec(50);
-                    }
-                    mPORTDClearBits(BIT_2);	// LED3=0
+                    chunkAt = ReadCoreTimer();
                 }
-                mPORTDClearBits(BIT_0); // LED1=0
             }
 
             // The client has closed the socket so we close as well
@@ -237,18 +272,39 @@ int main() {
             else if(rlen < 0) {
                 closesocket(clientSock);
                 clientSock = SOCKET_ERROR;
+                if(bytesSent < tlen) mPORTDClearBits(BIT_2);	// LED3=0
+                bytesSent = tlen;
             }
         }
     }
 }
 
-// Function : DelayMsec( )
+// Function : ledStart( )
 // 
-// Delays the program by specified millisecond passed
+// Starts led over with pattern, cutting short any animation still showing
 //
-void DelayMsec(unsigned int msec){
-    unsigned int tWait, tStart;
-    tWait=(SYS_FREQ/2000)*msec;
-    tStart=ReadCoreTimer();
-    while((ReadCoreTimer()-tStart)<tWait);
+void ledStart(struct ledAnimation *led, const unsigned int *pattern, 
+    int steps){
+    if(led->step < led->steps) mPORTDClearBits(led->pattern[led->step]);
+    led->pattern = pattern;
+    led->steps = steps;
+    led->step = 0;
+    led->stepAt = ReadCoreTimer() + LEDSTEPMSEC*TICKSPERMSEC;
+    mPORTDSetBits(pattern[0]);
+}
+
+// Function : ledStep( )
+// 
+// Moves led to its next step once the one showing is up and clears the
+// LEDs after the last. Returns at once otherwise.
+//
+void ledStep(struct ledAnimation *led){
+    if(led->step == led->steps) return;
+    if((int)(ReadCoreTimer() - led->stepAt) < 0) return;
+    mPORTDClearBits(led->pattern[led->step]);
+    led->step++;
+    if(led->step < led->steps){
+        mPORTDSetBits(led->pattern[led->step]);
+        led->stepAt += LEDSTEPMSEC*TICKSPERMSEC;
+    }
 }
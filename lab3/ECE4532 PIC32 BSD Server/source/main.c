@@ -22,6 +22,7 @@
 
 
 #include <string.h>
+#include <stdio.h>
 
 #include <plib.h>		// PIC32 Peripheral library functions and macros
 #include "tcpip_bsd_config.h"	// in \source
@@ -39,14 +40,154 @@
 #define bufferRows 5
 #define bufferCols 6
 
+// Limits of the block geometry a client can ask for. A block is cols chars
+// plus the column parity char. MAXCOLS keeps the column parity char useful
+// since more rows per block means more chance of two errors in a block.
+#define MINCOLS 1
+#define MAXCOLS 32
 
-void DelayMsec(unsigned int msec);
+// Bit interleaver. Frames of depth blocks, a multiple of 8 up to
+// MAXDEPTH, go out one bit column at a time so neighbouring wire bits
+// come from different blocks and a burst of up to depth bits leaves at
+// most one error in each block. Depth 0 turns it off.
+#define MAXDEPTH 32
+#define MAXFRAMELEN (MAXDEPTH*(MAXCOLS+1))
+
+// Size of the receive buffer. An echoed frame is only deinterleaved when
+// it arrives whole, so the depth is limited to frames that fit in it.
+#define RBFRLEN 256
+#define INTERLEAVEDEPTHS 4
+#define INTERLEAVEBENCHBLOCKS 256
+#define INTERLEAVEBENCHPASSES 8
+
+// An interleaved transfer is padded out to a whole frame
+#define TBFRLEN MAXFRAMELEN
+
+// Gilbert-Elliott channel of the interleaver benchmark. A burst starts
+// with BURSTSTARTPPM chance per bit, lasts BURSTLEN bits on average and
+// flips every bit in it with probability one half.
+#define BURSTSTARTPPM 500
+#define BURSTLEN 8
+
+// Number of encoded blocks collected before a send while streaming
+#define ENCODECHUNK 16
+
+// Core timer ticks per millisecond. The core timer runs at SYS_FREQ/2.
+#define TICKSPERMSEC (SYS_FREQ/2000)
+
+// Time each step of an LED animation lasts
+#define LEDSTEPMSEC 50
+
+// 1 runs the connect animation to the end before the client is served,
+// like the old DelayMsec blink, so setup-us can be compared both ways
+#define LEDBLOCKING 0
+
+// Decode status of a block, two bits each in the status vector
+#define BLOCKOK 0
+#define BLOCKCORRECTED 1
+#define BLOCKUNCORRECTABLE 2
+#define BLOCKSHORT 3
+
+// Status reply: 02 | blocks | corrected | uncorrectable | vector | 03 with
+// the counts two bytes each, MSB first, and four blocks per vector byte
+#define STATUSHEADERLEN 7
+#define STATUSLEN (STATUSHEADERLEN + 256/(MINCOLS+1)/4 + 1)
+
+// '0266' report. With every number at its widest the parity line is 97
+// chars, the interleaver table 54 plus 38 a depth and setup-us 22.
+#define REPORTLEN (97 + 54 + 38*INTERLEAVEDEPTHS + 22 + 1)
+
+// Number of blocks and passes used when benchmarking the parity encoders
+#define BENCHBLOCKS 64
+#define BENCHREPS 10
+
+// Even parity of every byte, generated by the preprocessor
+#define BYTEPAR(b) (((b) ^ (b)>>1 ^ (b)>>2 ^ (b)>>3 ^ (b)>>4 ^ (b)>>5 ^ \
+        (b)>>6 ^ (b)>>7) & 1)
+#define BYTEPAR4(b) BYTEPAR(b), BYTEPAR((b)+1), BYTEPAR((b)+2), \
+        BYTEPAR((b)+3)
+#define BYTEPAR16(b) BYTEPAR4(b), BYTEPAR4((b)+4), BYTEPAR4((b)+8), \
+        BYTEPAR4((b)+12)
+#define BYTEPAR64(b) BYTEPAR16(b), BYTEPAR16((b)+16), BYTEPAR16((b)+32), \
+        BYTEPAR16((b)+48)
+
+const unsigned char parityTable[256] = {BYTEPAR64(0), BYTEPAR64(64),
+                                        BYTEPAR64(128), BYTEPAR64(192)};
+
+// Encoded row of every char: the char shifted up one with its row parity
+// bit in the LSB
+#define ROWCODE(b) ((unsigned char)((b) << 1) | BYTEPAR((b) & 0x7F))
+#define ROWCODE4(b) ROWCODE(b), ROWCODE((b)+1), ROWCODE((b)+2), \
+        ROWCODE((b)+3)
+#define ROWCODE16(b) ROWCODE4(b), ROWCODE4((b)+4), ROWCODE4((b)+8), \
+        ROWCODE4((b)+12)
+#define ROWCODE64(b) ROWCODE16(b), ROWCODE16((b)+16), ROWCODE16((b)+32), \
+        ROWCODE16((b)+48)
+
+const unsigned char rowCodeTable[256] = {ROWCODE64(0), ROWCODE64(64),
+                                         ROWCODE64(128), ROWCODE64(192)};
+
+// State of a payload being encoded as it arrives. frame holds the
+// encoded blocks not sent yet followed by the rows of the block being
+// filled, col is the running column parity of that block.
+typedef struct
+{
+    int cols;
+    int depth;
+    int count;
+    unsigned char col;
+    int len;
+    char frame[MAXFRAMELEN];
+} ParityStream;
+
+// LED animation stepped from the main loop instead of waited out. Step i
+// lights the LEDs in pattern[i] for LEDSTEPMSEC. step is the step showing,
+// equal to steps once the animation is over, and stepAt the core timer
+// tick the next step is due at.
+typedef struct
+{
+    const unsigned int *pattern;
+    int steps;
+    int step;
+    unsigned int stepAt;
+} LedAnimation;
+
+// A new connection runs LED1 to LED3, a global reset flashes LED1 and a
+// transfer LED2
+const unsigned int ledConnect[3] = {BIT_0, BIT_1, BIT_2};
+const unsigned int ledReset[1] = {BIT_0};
+const unsigned int ledTransfer[1] = {BIT_1};
+
+void ledStart(LedAnimation *led, const unsigned int *pattern, int steps);
+void ledStep(LedAnimation *led);
 void evenParityEncoder(const char *myStr, char *transmitBuffer, int tlen);
 int hasEvenParity(char x);
 int hasPartialEvenParity(char x, int colCount);
 int hasEvenParityArray(char *rowBuffer, int rowBufferLen);
-void setColParity(char *rowBuffer, char *transmitBuffer, int colIndex);
-void evenParityDecoder(char *recieveBuffer, int rlen);
+void setColParity(char *rowBuffer, int rowBufferLen, char *transmitBuffer,
+        int colIndex);
+int parityBlockDecoder(char *recieveBuffer, int rlen, int cols,
+        unsigned char *status, int *corrected, int *uncorrectable);
+int statusFrame(char *reply, const unsigned char *status, int blocks,
+        int corrected, int uncorrectable);
+int blockGeometry(const char *rbfr, int rlen);
+int interleaveGeometry(int depth, int cols);
+int parityEncoder(const char *myStr, int len, int cols, char *transmitBuffer);
+void parityStreamInit(ParityStream *ps, int cols, int depth);
+int parityStreamSend(SOCKET clientSock, ParityStream *ps, const char *bfr,
+        int len);
+void parityStreamFlush(SOCKET clientSock, ParityStream *ps, int n);
+int columnParityError(const char *block, int blockLen);
+int parityBenchmark(const char *myStr, char *report);
+void transpose8(const unsigned char *in, unsigned char *out);
+void interleave(const char *in, char *out, int rowLen, int depth);
+void deinterleave(const char *in, char *out, int rowLen, int depth);
+int padBlocks(char *bfr, int len, int cols, int depth);
+void interleaveBlocks(char *bfr, int len, int cols, int depth);
+void deinterleaveBlocks(char *bfr, int len, int cols, int depth);
+unsigned int randPpm(void);
+void burstChannel(char *bfr, int len);
+int interleaveBenchmark(const char *myStr, char *report);
 
 int main()
 {
@@ -61,7 +202,29 @@ int main()
 
     // Initialize the Send/Recv buffers
     //
-    char rbfr[256];
+    char rbfr[RBFRLEN];
+    char report[REPORTLEN];
+    char reply[STATUSLEN];
+
+    // Per block decode status of the last received buffer
+    //
+    unsigned char blockStatus[STATUSLEN];
+    int blocks, corrected, uncorrectable;
+
+    // Block geometry of the current transfer and the state of a payload
+    // being streamed out
+    //
+    int blockCols = bufferCols;
+    int interleaveDepth = 0;
+    int streamEncoding = 0;
+    ParityStream encodeStream;
+
+    // LED animation the loop steps, and how long in core timer ticks the
+    // last client waited from accept until its first message was read
+    //
+    LedAnimation led = {NULL, 0, 0, 0};
+    unsigned int acceptedAt, setupTicks = 0;
+    int setupPending = 0;
 
     // Socket struct descriptor
     //
@@ -128,12 +291,10 @@ int main()
 
     //chartransmitBuffer[bufferRows*(bufferCols+1)];
     //evenParityEncoder(myStr, transmitBuffer);
-    tlen = bufferRows*(bufferCols+1);
-
     //char *transmitBuffer = (char *)malloc(tlen*sizeof(char));
-    char transmitBuffer[tlen];
+    char transmitBuffer[TBFRLEN];
     
-    evenParityEncoder(myStr, transmitBuffer, tlen);
+    tlen = parityEncoder(myStr, strlen(myStr), blockCols, transmitBuffer);
 
     // Loop forever
     //
@@ -143,6 +304,7 @@ int main()
         //
         TCPIPProcess();
         DHCPTask();
+        ledStep(&led);
 
         // set the machines IP address and save to variable
         //
@@ -164,17 +326,14 @@ int main()
             //
             if (clientSock != INVALID_SOCKET) 
             {
+                acceptedAt = ReadCoreTimer();
+                setupPending = 1;
                 setsockopt(clientSock, SOL_SOCKET, TCP_NODELAY, 
                     (char*)&tlen, sizeof(int));
-                mPORTDSetBits(BIT_0); // LED1=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_0); // LED1=0
-                mPORTDSetBits(BIT_1); // LED2=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_1); // LED2=0
-                mPORTDSetBits(BIT_2); // LED3=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_2); // LED3=0
+                ledStart(&led, ledConnect, 3);
+#if LEDBLOCKING
+                while (led.step < led.steps) ledStep(&led);
+#endif
             }
         } else 
         {
@@ -188,42 +347,128 @@ int main()
             //
             if (rlen > 0) 
             {
+                // The first message read ends the connection setup
+                if (setupPending)
+                {
+                    setupTicks = ReadCoreTimer() - acceptedAt;
+                    setupPending = 0;
+                }
+
+                // A stream encode is in progress so the message is more
+                // payload. Encode it up to the '03' end of message.
+                if (streamEncoding)
+                {
+                    streamEncoding = parityStreamSend(clientSock,
+                            &encodeStream, rbfr, rlen);
+                }
                 // If the received message first byte is '02' it signifies
                 // a start of message
                 //
-                if (rbfr[0] == 2) 
+                else if (rbfr[0] == 2) 
                 {
+                    mPORTDClearBits(BIT_0); // LED1=0
+
                     // Check to see if message begins with
                     // '0271' signifying message is a global reset
                     if (rbfr[1] == 71) 
                     {
-                        mPORTDSetBits(BIT_0); // LED1=1
-                        DelayMsec(50);
-                        mPORTDClearBits(BIT_0); // LED1=0
+                        ledStart(&led, ledReset, 1);
                     }
                     // Check to see if message begins with 
-                    // '0284' signifying message is a start of a transfer
+                    // '0284' signifying message is a start of a transfer.
+                    // An optional third byte sets the chars per block.
                     else if(rbfr[1]==84)
                     {
+                        blockCols = blockGeometry(rbfr, rlen);
+                        interleaveDepth = interleaveGeometry(interleaveDepth,
+                                blockCols);
+                        tlen = parityEncoder(myStr, strlen(myStr), blockCols,
+                                transmitBuffer);
+                        if (interleaveDepth)
+                        {
+                            tlen = padBlocks(transmitBuffer, tlen, blockCols,
+                                    interleaveDepth);
+                            interleaveBlocks(transmitBuffer, tlen, blockCols,
+                                    interleaveDepth);
+                        }
                         mPORTDClearBits(BIT_0);
                         mPORTDSetBits(BIT_1);   // LED3=1
                         send(clientSock, transmitBuffer, tlen, 0);
-                        DelayMsec(50);
-                        mPORTDClearBits(BIT_1);	// LED3=0
+                        ledStart(&led, ledTransfer, 1);
+                    }
+                    // Check to see if message begins with
+                    // '0266' signifying a parity benchmark request. The
+                    // results are sent back as text.
+                    else if(rbfr[1]==66)
+                    {
+                        mPORTDSetBits(BIT_1);   // LED2=1
+                        rlen = parityBenchmark(myStr, report);
+                        rlen += interleaveBenchmark(myStr, report+rlen);
+                        rlen += sprintf(report+rlen, "setup-us\r\n%u\r\n",
+                                setupTicks/(TICKSPERMSEC/1000));
+                        send(clientSock, report, rlen, 0);
+                        mPORTDClearBits(BIT_1);	// LED2=0
+                    }
+                    // Check to see if message begins with
+                    // '0280' signifying a client payload to encode. The
+                    // third byte sets the chars per block and the rest is
+                    // payload, which can go on over more messages up to the
+                    // '03' end of message.
+                    else if(rbfr[1]==80 && rlen > 2)
+                    {
+                        blockCols = blockGeometry(rbfr, rlen);
+                        interleaveDepth = interleaveGeometry(interleaveDepth,
+                                blockCols);
+                        parityStreamInit(&encodeStream, blockCols,
+                                interleaveDepth);
+                        streamEncoding = parityStreamSend(clientSock,
+                                &encodeStream, rbfr+3, rlen-3);
+                    }
+                    // Check to see if message begins with
+                    // '0273' signifying an interleaver change. The third
+                    // byte is the depth in blocks for the transfers that
+                    // follow, 0 or anything not a multiple of 8 up to
+                    // MAXDEPTH turns it off. So does a depth whose frames
+                    // would not fit in rbfr, checked again whenever a
+                    // transfer changes the block geometry.
+                    else if(rbfr[1]==73 && rlen > 2)
+                    {
+                        interleaveDepth = interleaveGeometry(rbfr[2],
+                                blockCols);
                     }
-                mPORTDClearBits(BIT_0); // LED1=0
                 }
                 // If not prefixed we say client is sending back our
                 // transmits corrupted packet.
                 else
                 {
-                    // receive possible corrupted data
-                    evenParityDecoder(rbfr, rlen);
+                    // receive possible corrupted data and correct every
+                    // block we can. Interleaved data is put back in block
+                    // order first and interleaved again for the echo.
+                    if (interleaveDepth)
+                    {
+                        deinterleaveBlocks(rbfr, rlen, blockCols,
+                                interleaveDepth);
+                    }
+                    blocks = parityBlockDecoder(rbfr, rlen, blockCols,
+                            blockStatus, &corrected, &uncorrectable);
+                    if (interleaveDepth)
+                    {
+                        interleaveBlocks(rbfr, rlen, blockCols,
+                                interleaveDepth);
+                    }
+
+                    // Red LED shows the buffer had blocks we could not fix
+                    if (uncorrectable > 0) mPORTDSetBits(BIT_0);
+                    else mPORTDClearBits(BIT_0);
 
                     //send data back across the socket 
-                    // (for viewing in wireshark)
+                    // (for viewing in wireshark) followed by the status
+                    // of every block
                     mPORTDSetBits(BIT_2);   // LED3=1
                     send(clientSock, rbfr, rlen, 0);
+                    rlen = statusFrame(reply, blockStatus, blocks, corrected,
+                            uncorrectable);
+                    send(clientSock, reply, rlen, 0);
                     mPORTDClearBits(BIT_2);   // LED3=1
                 }
                 // The client has closed the socket so we close as well
@@ -233,68 +478,126 @@ int main()
             {
                     closesocket(clientSock);
                     clientSock = SOCKET_ERROR;
+
+                    // A stream the client left unfinished ends with it, so
+                    // the next client's commands are not taken as payload
+                    streamEncoding = 0;
+                    parityStreamInit(&encodeStream, blockCols,
+                            interleaveDepth);
             }
         }   
     }
 }
 
-// Function : DelayMsec( )
-// 
-// Delays the program by specified millisecond passed
-void DelayMsec(unsigned int msec) 
+// Starts led over with pattern, cutting short any animation still showing
+void ledStart(LedAnimation *led, const unsigned int *pattern, int steps)
 {
-    unsigned int tWait, tStart;
-    tWait = (SYS_FREQ / 2000) * msec;
-    tStart = ReadCoreTimer();
-    while ((ReadCoreTimer() - tStart) < tWait);
+    if (led->step < led->steps) mPORTDClearBits(led->pattern[led->step]);
+    led->pattern = pattern;
+    led->steps = steps;
+    led->step = 0;
+    led->stepAt = ReadCoreTimer() + LEDSTEPMSEC*TICKSPERMSEC;
+    mPORTDSetBits(pattern[0]);
 }
 
-void evenParityDecoder(char *recieveBuffer, int rlen)
+// Moves led to its next step once the one showing is up and clears the
+// LEDs after the last. Returns at once otherwise.
+void ledStep(LedAnimation *led)
 {
-    int i;
-    int j = 0;
-    int colError;
-    
-    // Plus one for the col parity bit character
-    char rowBuffer[bufferCols+1];
-    
-    // First we check column parity chars
-    for(i=0; i < rlen; i+=bufferCols+1)
+    if (led->step == led->steps) return;
+    if ((int)(ReadCoreTimer() - led->stepAt) < 0) return;
+    mPORTDClearBits(led->pattern[led->step]);
+    led->step++;
+    if (led->step < led->steps)
     {
-        // create a buffer to hold our row and col parity bit character
-        memcpy(rowBuffer, recieveBuffer+i, bufferCols+1);
-        
-        // check if array of characters has even parity along the column
-        colError = hasEvenParityArray(rowBuffer, bufferCols+1);
+        mPORTDSetBits(led->pattern[led->step]);
+        led->stepAt += LEDSTEPMSEC*TICKSPERMSEC;
+    }
+}
+
+// Checks every block of recieveBuffer in one pass and corrects the blocks
+// with a single bit error in place. A block with one odd row and one odd
+// column has the bit where they cross flipped; this includes errors in the
+// parity bits since the column parity char has even row parity too. Any
+// other mix of odd rows and columns is more than one error. The status of
+// every block goes into status, a short block at the end is BLOCKSHORT.
+// The work is the same for every block so decode time only depends on
+// rlen. Returns the number of blocks.
+int parityBlockDecoder(char *recieveBuffer, int rlen, int cols,
+        unsigned char *status, int *corrected, int *uncorrectable)
+{
+    int i, j, b;
+    int badRow, badRows, blockStatus;
+    unsigned char fold, row;
+    char *block;
 
-        // if a column char doesn't have even parity then we know 
-        // there is an error
-        if (colError >= 0)
+    *corrected = 0;
+    *uncorrectable = 0;
+    for(i=0, b=0; i < rlen; i+=cols+1, b++)
+    {
+        block = recieveBuffer+i;
+        if (i+cols+1 > rlen)
         {
-            // Set led 1 (red) high
-            mPORTDSetBits(BIT_0);
-            for(j=0; j < bufferCols; j++)
+            blockStatus = BLOCKSHORT;
+            (*uncorrectable)++;
+        }
+        else
+        {
+            // XOR of the rows has a bit set for every odd column
+            fold = 0;
+            badRow = 0;
+            badRows = 0;
+            for(j=0; j <= cols; j++)
             {
-                if (hasEvenParity(rowBuffer[j])==0)
+                row = block[j];
+                fold ^= row;
+                if (parityTable[row])
                 {
-                    // flip the problem bit
-                    rowBuffer[j] ^= (0x01 << colError);
-
-                    // Correct the received data. 
-                    recieveBuffer[i+j] = rowBuffer[j];
-                    return;
+                    badRow = j;
+                    badRows++;
                 }
             }
-            // We detected an error but is was a in the parity col. We blink 
-            // led 1 (red))
-            DelayMsec(100);
-            mPORTDClearBits(BIT_0);
-            DelayMsec(100);
-            mPORTDSetBits(BIT_0);
-            DelayMsec(100);
-            mPORTDClearBits(BIT_0);
+
+            if (badRows == 0 && fold == 0)
+            {
+                blockStatus = BLOCKOK;
+            }
+            else if (badRows == 1 && fold != 0 && (fold & (fold-1)) == 0)
+            {
+                block[badRow] ^= fold;
+                blockStatus = BLOCKCORRECTED;
+                (*corrected)++;
+            }
+            else
+            {
+                blockStatus = BLOCKUNCORRECTABLE;
+                (*uncorrectable)++;
+            }
         }
+
+        // Four blocks per byte, first block in the top bits
+        if ((b & 3) == 0) status[b >> 2] = 0;
+        status[b >> 2] |= blockStatus << (6 - 2*(b & 3));
     }
+    return b;
+}
+
+// Builds the status reply for a decoded buffer. Returns its length.
+int statusFrame(char *reply, const unsigned char *status, int blocks,
+        int corrected, int uncorrectable)
+{
+    int vlen = (blocks+3)/4;
+
+    reply[0] = 2;
+    reply[1] = blocks >> 8;
+    reply[2] = blocks;
+    reply[3] = corrected >> 8;
+    reply[4] = corrected;
+    reply[5] = uncorrectable >> 8;
+    reply[6] = uncorrectable;
+    memcpy(reply+STATUSHEADERLEN, status, vlen);
+    reply[STATUSHEADERLEN+vlen] = 3;
+    return STATUSHEADERLEN+vlen+1;
 }
 
 void evenParityEncoder(const char *myStr, char *transmitBuffer, int tlen) 
@@ -309,9 +612,9 @@ void evenParityEncoder(const char *myStr, char *transmitBuffer, int tlen)
     for(i=0; i < tlen; i++)
     {
         // Check if we are calculating col parity
-        if(i!=0 && (j==6))
+        if(i!=0 && (j==bufferCols))
         {
-            setColParity(rowBuffer, transmitBuffer, i);          
+            setColParity(rowBuffer, bufferCols, transmitBuffer, i);
             j = 0;
             continue;
         }
@@ -363,10 +666,11 @@ int hasPartialEvenParity(char x, int colCount)
     return 1;
 }
 
-void setColParity(char *rowBuffer, char *transmitBuffer, int colIndex) 
+// rowBuffer is not null terminated so the number of rows is passed in
+void setColParity(char *rowBuffer, int rowBufferLen, char *transmitBuffer,
+        int colIndex) 
 {
     int i, j;
-    int rowBufferLen = strlen(rowBuffer);
     char colBitBuffer;
     
     transmitBuffer[colIndex] = 0;
@@ -408,3 +712,412 @@ int hasEvenParityArray(char *rowBuffer, int rowBufferLen)
     }
     return -1;
 }
+
+// Encodes len chars of myStr in blocks of cols chars. Every row is one
+// lookup in rowCodeTable and the column parity char of a block is the XOR
+// of its rows, since even parity down a column is the XOR of that bit
+// over the rows. A short last block is padded with zero chars, which
+// encode to zero and leave the column parity alone. Returns the number of
+// chars written.
+int parityEncoder(const char *myStr, int len, int cols, char *transmitBuffer)
+{
+    int i, j;
+    unsigned char row, col;
+    char *start = transmitBuffer;
+
+    for(i=0; i < len; i+=cols)
+    {
+        col = 0;
+        for(j=0; j < cols; j++)
+        {
+            row = (i+j < len) ? rowCodeTable[(unsigned char)*myStr++] : 0;
+            *transmitBuffer++ = row;
+            col ^= row;
+        }
+        *transmitBuffer++ = col;
+    }
+    return transmitBuffer - start;
+}
+
+// Reads the chars per block from the third byte of a transfer command.
+// Falls back to bufferCols when the client leaves it out or asks for one
+// outside MINCOLS to MAXCOLS.
+int blockGeometry(const char *rbfr, int rlen)
+{
+    if (rlen > 2 && rbfr[2] >= MINCOLS && rbfr[2] <= MAXCOLS) return rbfr[2];
+    return bufferCols;
+}
+
+// Checks an interleaver depth against blocks of cols chars. Returns the
+// depth, or 0 to turn interleaving off when it is not a multiple of 8 up
+// to MAXDEPTH or a frame would not fit in one receive.
+int interleaveGeometry(int depth, int cols)
+{
+    if (depth < 8 || depth > MAXDEPTH || (depth & 7)) return 0;
+    if (depth*(cols+1) > RBFRLEN) return 0;
+    return depth;
+}
+
+void parityStreamInit(ParityStream *ps, int cols, int depth)
+{
+    ps->cols = cols;
+    ps->depth = depth;
+    ps->count = 0;
+    ps->col = 0;
+    ps->len = 0;
+}
+
+// Encodes the next piece of a streamed payload and sends the finished
+// blocks to the client ENCODECHUNK at a time, or a frame at a time when
+// interleaving, so the whole payload never has to be in memory. Returns 0
+// once the '03' end of message has been seen and the last block and frame
+// padded and sent, otherwise 1.
+int parityStreamSend(SOCKET clientSock, ParityStream *ps, const char *bfr,
+        int len)
+{
+    int chunk = (ps->depth ? ps->depth : ENCODECHUNK)*(ps->cols+1);
+    int i, end;
+    unsigned char row;
+
+    for(end=0; end < len && bfr[end] != 3; end++);
+
+    mPORTDSetBits(BIT_2);   // LED3=1
+    for(i=0; i < end; i++)
+    {
+        row = rowCodeTable[(unsigned char)bfr[i]];
+        ps->frame[ps->len++] = row;
+        ps->col ^= row;
+        if (++ps->count == ps->cols)
+        {
+            ps->frame[ps->len++] = ps->col;
+            ps->count = 0;
+            ps->col = 0;
+            if (ps->len == chunk) parityStreamFlush(clientSock, ps, ps->len);
+        }
+    }
+
+    if (end < len)
+    {
+        // Pad out the last block and frame now that the payload is over
+        if (ps->count > 0)
+        {
+            memset(ps->frame+ps->len, 0, ps->cols - ps->count);
+            ps->len += ps->cols - ps->count;
+            ps->frame[ps->len++] = ps->col;
+            ps->count = 0;
+            ps->col = 0;
+        }
+        if (ps->depth && ps->len > 0)
+        {
+            ps->len = padBlocks(ps->frame, ps->len, ps->cols, ps->depth);
+        }
+        parityStreamFlush(clientSock, ps, ps->len);
+    }
+    else if (!ps->depth)
+    {
+        // Without interleaving the whole blocks can go now
+        parityStreamFlush(clientSock, ps, ps->len - ps->count);
+    }
+    mPORTDClearBits(BIT_2);	// LED3=0
+
+    return end == len;
+}
+
+// Sends the first n chars of the stream frame, interleaved if asked for,
+// and moves anything after them to the front
+void parityStreamFlush(SOCKET clientSock, ParityStream *ps, int n)
+{
+    if (n == 0) return;
+    if (ps->depth) interleaveBlocks(ps->frame, n, ps->cols, ps->depth);
+    send(clientSock, ps->frame, n, 0);
+    memmove(ps->frame, ps->frame+n, ps->len-n);
+    ps->len -= n;
+}
+
+// Same result as hasEvenParityArray: the lowest bit column of the block
+// with odd parity, or -1 if every column is even. The XOR of all the rows
+// has a bit set for every odd column.
+int columnParityError(const char *block, int blockLen)
+{
+    unsigned char fold = 0;
+    int i;
+
+    for(i=0; i < blockLen; i++)
+    {
+        fold ^= block[i];
+    }
+    if (fold == 0) return -1;
+
+    for(i=0; (fold & (0x01 << i)) == 0; i++);
+    return i;
+}
+
+// Times the bit loop encoder and check against the table encoder and XOR
+// fold on BENCHBLOCKS blocks and writes the cycles per block of each into
+// report. The core timer runs at half the system clock so every tick is
+// two CPU cycles. Returns the report length.
+int parityBenchmark(const char *myStr, char *report)
+{
+    static char msg[BENCHBLOCKS*bufferCols];
+    static char bfr[BENCHBLOCKS*(bufferCols+1)];
+    int blen = BENCHBLOCKS*(bufferCols+1);
+    unsigned int tStart;
+    unsigned int legacyEncode, tableEncode, legacyCheck, tableCheck;
+    int i, j, slen;
+    volatile int result = 0;
+
+    // Repeat the message until the buffer is full
+    slen = strlen(myStr);
+    for(i=0; i < BENCHBLOCKS*bufferCols; i++)
+    {
+        msg[i] = myStr[i % slen];
+    }
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        evenParityEncoder(msg, bfr, blen);
+    }
+    legacyEncode = ReadCoreTimer() - tStart;
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        parityEncoder(msg, BENCHBLOCKS*bufferCols, bufferCols, bfr);
+    }
+    tableEncode = ReadCoreTimer() - tStart;
+
+    // Row and column checks of every block, as the decoder does them
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        for(j=0; j < blen; j+=bufferCols+1)
+        {
+            result += hasEvenParityArray(bfr+j, bufferCols+1);
+            result += hasEvenParity(bfr[j]);
+        }
+    }
+    legacyCheck = ReadCoreTimer() - tStart;
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        for(j=0; j < blen; j+=bufferCols+1)
+        {
+            result += columnParityError(bfr+j, bufferCols+1);
+            result += parityTable[(unsigned char)bfr[j]];
+        }
+    }
+    tableCheck = ReadCoreTimer() - tStart;
+
+    return sprintf(report, "cycles/block encode legacy=%u table=%u "
+            "check legacy=%u table=%u\r\n",
+            2*legacyEncode/(BENCHREPS*BENCHBLOCKS),
+            2*tableEncode/(BENCHREPS*BENCHBLOCKS),
+            2*legacyCheck/(BENCHREPS*BENCHBLOCKS),
+            2*tableCheck/(BENCHREPS*BENCHBLOCKS));
+}
+
+// Transposes an 8x8 bit matrix held one row per byte. Bit b of in[r] ends
+// up in bit 7-r of out[7-b]. Applying it twice gives back the original.
+// From Hacker's Delight, section 7-3.
+void transpose8(const unsigned char *in, unsigned char *out)
+{
+    unsigned int x, y, t;
+
+    x = ((unsigned int)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+    y = ((unsigned int)in[4] << 24) | (in[5] << 16) | (in[6] << 8) | in[7];
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA;  x = x ^ t ^ (t << 7);
+    t = (y ^ (y >> 7)) & 0x00AA00AA;  y = y ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC; x = x ^ t ^ (t << 14);
+    t = (y ^ (y >> 14)) & 0x0000CCCC; y = y ^ t ^ (t << 14);
+    t = (x & 0xF0F0F0F0) | ((y >> 4) & 0x0F0F0F0F);
+    y = ((x << 4) & 0xF0F0F0F0) | (y & 0x0F0F0F0F);
+    x = t;
+
+    out[0] = x >> 24; out[1] = x >> 16; out[2] = x >> 8; out[3] = x;
+    out[4] = y >> 24; out[5] = y >> 16; out[6] = y >> 8; out[7] = y;
+}
+
+// Interleaves one frame of depth blocks of rowLen chars each. Every group
+// of 8 blocks has its chars at the same offset gathered and bit
+// transposed, so wire char (c*8 + k)*groups + g holds bit k of char c of
+// blocks 8g to 8g+7. The transpose works on two words in registers so the
+// frame is only read and written once.
+void interleave(const char *in, char *out, int rowLen, int depth)
+{
+    unsigned char col[8], bits[8];
+    int groups = depth/8;
+    int c, g, k;
+
+    for(c=0; c < rowLen; c++)
+    {
+        for(g=0; g < groups; g++)
+        {
+            for(k=0; k < 8; k++) col[k] = in[(8*g+k)*rowLen + c];
+            transpose8(col, bits);
+            for(k=0; k < 8; k++) out[(c*8+k)*groups + g] = bits[k];
+        }
+    }
+}
+
+// Undoes interleave. transpose8 is its own inverse so it is the same
+// gather and scatter the other way round.
+void deinterleave(const char *in, char *out, int rowLen, int depth)
+{
+    unsigned char col[8], bits[8];
+    int groups = depth/8;
+    int c, g, k;
+
+    for(c=0; c < rowLen; c++)
+    {
+        for(g=0; g < groups; g++)
+        {
+            for(k=0; k < 8; k++) bits[k] = in[(c*8+k)*groups + g];
+            transpose8(bits, col);
+            for(k=0; k < 8; k++) out[(8*g+k)*rowLen + c] = col[k];
+        }
+    }
+}
+
+// Pads len chars of encoded blocks out to a whole number of frames with
+// zero blocks, which have even parity. Returns the padded length.
+int padBlocks(char *bfr, int len, int cols, int depth)
+{
+    int frameLen = depth*(cols+1);
+
+    if (len % frameLen)
+    {
+        memset(bfr+len, 0, frameLen - len % frameLen);
+        len += frameLen - len % frameLen;
+    }
+    return len;
+}
+
+// Interleaves the whole frames of bfr in place. A partial frame at the end
+// is left as it is.
+void interleaveBlocks(char *bfr, int len, int cols, int depth)
+{
+    static char frame[MAXFRAMELEN];
+    int frameLen = depth*(cols+1);
+    int i;
+
+    for(i=0; i+frameLen <= len; i+=frameLen)
+    {
+        interleave(bfr+i, frame, cols+1, depth);
+        memcpy(bfr+i, frame, frameLen);
+    }
+}
+
+// Puts the whole frames of bfr back in block order in place
+void deinterleaveBlocks(char *bfr, int len, int cols, int depth)
+{
+    static char frame[MAXFRAMELEN];
+    int frameLen = depth*(cols+1);
+    int i;
+
+    for(i=0; i+frameLen <= len; i+=frameLen)
+    {
+        deinterleave(bfr+i, frame, cols+1, depth);
+        memcpy(bfr+i, frame, frameLen);
+    }
+}
+
+// Uniform random number from 0 to 999999. rand() only goes up to 32767
+// on the PIC32 so it takes two draws.
+unsigned int randPpm(void)
+{
+    return (rand() % 1000)*1000 + rand() % 1000;
+}
+
+// Gilbert-Elliott burst channel over len chars, LSB of each char first
+void burstChannel(char *bfr, int len)
+{
+    int i, j, burst = 0;
+
+    for(i=0; i < len; i++)
+    {
+        for(j=0; j < 8; j++)
+        {
+            if (burst) burst = (rand() % BURSTLEN) != 0;
+            else burst = randPpm() < BURSTSTARTPPM;
+            if (burst && (rand() & 1)) bfr[i] ^= 1 << j;
+        }
+    }
+}
+
+// Sends INTERLEAVEBENCHBLOCKS blocks of myStr through the burst channel
+// INTERLEAVEBENCHPASSES times without interleaving and at each depth, and
+// appends the residual message bit error rate, the uncorrectable blocks
+// over all passes and the cycles per char of interleaving plus
+// deinterleaving to report. Every depth sees the same random sequence.
+// Returns the number of chars appended.
+int interleaveBenchmark(const char *myStr, char *report)
+{
+    static const int depths[INTERLEAVEDEPTHS] = {0, 8, 16, 32};
+    static char msg[INTERLEAVEBENCHBLOCKS*bufferCols];
+    static char coded[INTERLEAVEBENCHBLOCKS*(bufferCols+1)];
+    static char rx[INTERLEAVEBENCHBLOCKS*(bufferCols+1)];
+    static unsigned char status[INTERLEAVEBENCHBLOCKS/4];
+    int clen = INTERLEAVEBENCHBLOCKS*(bufferCols+1);
+    unsigned int tStart, ticks;
+    int corrected, uncorrectable, badBlocks;
+    int d, i, j, pass, errors, slen, len = 0;
+    unsigned char diff;
+
+    slen = strlen(myStr);
+    for(i=0; i < INTERLEAVEBENCHBLOCKS*bufferCols; i++)
+    {
+        msg[i] = myStr[i % slen];
+    }
+    parityEncoder(msg, INTERLEAVEBENCHBLOCKS*bufferCols, bufferCols, coded);
+
+    len += sprintf(report+len, "interleave depth residual-ppm "
+            "bad-blocks cycles/char\r\n");
+    for(d=0; d < INTERLEAVEDEPTHS; d++)
+    {
+        ticks = 0;
+        if (depths[d])
+        {
+            memcpy(rx, coded, clen);
+            tStart = ReadCoreTimer();
+            for(i=0; i < BENCHREPS; i++)
+            {
+                interleaveBlocks(rx, clen, bufferCols, depths[d]);
+                deinterleaveBlocks(rx, clen, bufferCols, depths[d]);
+            }
+            ticks = ReadCoreTimer() - tStart;
+        }
+
+        srand(1);
+        errors = 0;
+        badBlocks = 0;
+        for(pass=0; pass < INTERLEAVEBENCHPASSES; pass++)
+        {
+            memcpy(rx, coded, clen);
+            if (depths[d]) interleaveBlocks(rx, clen, bufferCols, depths[d]);
+            burstChannel(rx, clen);
+            if (depths[d]) deinterleaveBlocks(rx, clen, bufferCols, depths[d]);
+            parityBlockDecoder(rx, clen, bufferCols, status, &corrected,
+                    &uncorrectable);
+            badBlocks += uncorrectable;
+
+            // The data bits of a row are the char shifted up one
+            for(i=0; i < INTERLEAVEBENCHBLOCKS; i++)
+            {
+                for(j=0; j < bufferCols; j++)
+                {
+                    diff = ((unsigned char)rx[i*(bufferCols+1)+j] >> 1 ^
+                            msg[i*bufferCols+j]) & 0x7F;
+                    for(; diff; diff &= diff-1) errors++;
+                }
+            }
+        }
+        len += sprintf(report+len, "%d %u %d %u\r\n", depths[d],
+                1000000/7*errors/(INTERLEAVEBENCHPASSES*
+                INTERLEAVEBENCHBLOCKS*bufferCols), badBlocks,
+                2*ticks/(BENCHREPS*clen));
+    }
+    return len;
+}
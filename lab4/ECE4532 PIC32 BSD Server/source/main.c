@@ -22,6 +22,7 @@
 
 
 #include <string.h>
+#include <stdio.h>
 
 #include <plib.h>		// PIC32 Peripheral library functions and macros
 #include "tcpip_bsd_config.h"	// in \source
@@ -40,14 +41,324 @@
 #define CODEWORDLEN 6
 #define MSGLEN 42
 
-void DelayMsec(unsigned int msec);
-void hammingDecoder(char *recieveBuffer, int rlen);
+// Decoder modes. The legacy decoder does the bit level matrix math and
+// LED blinking for every byte, the table decoder looks the syndrome and
+// correction mask up in precomputed tables.
+#define DECODELEGACY 0
+#define DECODETABLE 1
+
+// The batch decoder bit slices BATCHLEN codewords at a time: bit b of
+// every codeword in the batch is gathered into one plane of words so the
+// syndrome and correction of the whole batch are a few dozen logic ops.
+// What is left over at the end of a buffer goes through the table decoder.
+#define DECODEBATCH 2
+#define BATCHLEN 64
+#define BATCHWORDS (BATCHLEN/32)
+
+// Codewords in the batch benchmark buffer and the total amount of data
+// pushed through each decoder
+#define BATCHBENCHLEN 4096
+#define BATCHBENCHBYTES (2*1024*1024)
+
+// Marks a syndrome with no single bit correction in hammingCorrectTable
+#define UNCORRECTABLE 0xFF
+
+// Number of passes over the buffer when benchmarking the decoders
+#define BENCHREPS 100
+
+// Size of the message used by the encoder benchmark. A multiple of three
+// chars so the legacy encoder ends on a whole packet.
+#define BENCHMSGLEN 252
+
+// Codewords sent per send() call while stream encoding
+#define ENCODECHUNK 128
+
+// Wire format header flags. A codeword never uses its top two bits so a
+// first byte with either set can only be a header. Packed frames lay the
+// codewords end to end and keep the number of pad bits at the end of the
+// last byte in the low nibble of the header.
+#define WIREHEADERMASK 0xC0
+#define WIREUNPACKED 0x40
+#define WIREPACKED 0x80
+#define WIREPADMASK 0x0F
+
+// Frames of the selectable code family below. The low nibble of the header
+// is the index of the code in hammingCodes and the next two bytes are the
+// number of chars encoded (MSB first), so the decoder can tell the last
+// char from the padding of the last block.
+#define WIRECODED 0xC0
+#define CODEDHEADERLEN 3
+
+// Largest number of codewords a full receive buffer can unpack into
+#define UNPACKLEN (256*8/CODEWORDLEN)
+
+// Decoded reply: '02', corrected and uncorrectable counts (two bytes each,
+// MSB first), the decoded ASCII message and '03'. No code in use has a
+// rate above 7/8 so a full receive buffer never decodes to more than
+// 256 chars.
+#define REPLYHEADERLEN 5
+#define REPLYLEN (REPLYHEADERLEN + 256 + 1)
+
+// Bit error rate of the simulated channel in the code benchmark, in errors
+// per million bits
+#define BENCHBERPPM 5000
+
+// Hamming code family. Codewords use the classic positional layout: bit
+// p-1 of the codeword holds Hamming position p, parity bits sit at the
+// power of two positions and the syndrome is the position in error. SECDED
+// codes add an overall parity bit at bit n.
+#define HAMMING74 0
+#define HAMMING1511 1
+#define HAMMING3126 2
+#define SECDED84 3
+#define SECDED1611 4
+#define SECDED3226 5
+
+// Binary BCH codes of length 31 over GF(2^5) correcting t=2 and t=3
+// errors per block. Codewords are systematic: the data sits above the
+// n-k parity bits and bit i is the coefficient of x^i.
+#define BCH3121 6
+#define BCH3116 7
+#define HAMMINGCODES 8
+
+#define GFM 5
+#define GFN ((1 << GFM)-1)
+#define GFPOLY 0x25         // x^5 + x^2 + 1
+#define BCHMAXT 3
+
+// Error weights tried by the BCH benchmark go up to one past BCHMAXT
+#define BCHBENCHREPS 200
+
+// Rate 1/2, K=7 convolutional code with the usual 171/133 octal
+// generators. It is a streaming code so it sits outside the block code
+// table but shares the WIRECODED header. Frames are the coded bits two per
+// message bit, MSB first, ending with K-1 zero tail bits and zero padding.
+#define CONVK7 8
+#define CONVK 7
+#define CONVSTATES (1 << (CONVK-1))
+#define CONVG1 0x79
+#define CONVG2 0x5B
+
+// The Viterbi decoder traces back over TBLEN steps and commits the oldest
+// TBDEPTH bits, so every bit is decided with at least TBDEPTH (about 7K)
+// steps of look ahead
+#define TBDEPTH 48
+#define TBLEN (2*TBDEPTH)
+
+// Channel bit error rates tried by the Viterbi benchmark, in errors per
+// million bits
+#define CONVBENCHRATES 5
+
+// Bit interleaver. Frames of depth codewords, a multiple of 8 up to
+// MAXDEPTH, go out one bit column at a time so neighbouring wire bits
+// come from different codewords and a burst of up to depth bits leaves at
+// most one error in each. The frame header is WIREINTERLEAVED, the depth
+// and the number of codewords before padding (two bytes, MSB first).
+#define WIREINTERLEAVED (WIRECODED | 0x0F)
+#define INTERLEAVEHEADERLEN 4
+#define MAXDEPTH 32
+#define INTERLEAVEDEPTHS 4
+
+// Gilbert-Elliott channel of the interleaver benchmark. A burst starts
+// with BURSTSTARTPPM chance per bit, lasts BURSTLEN bits on average and
+// flips every bit in it with probability one half.
+#define BURSTSTARTPPM 2000
+#define BURSTLEN 8
+
+// Core timer ticks per millisecond. The core timer runs at SYS_FREQ/2.
+#define TICKSPERMSEC (SYS_FREQ/2000)
+
+// Time each step of an LED animation lasts
+#define LEDSTEPMSEC 50
+
+// 1 runs the connect animation to the end before the client is served,
+// like the old DelayMsec blink, so setup-us can be compared both ways
+#define LEDBLOCKING 0
+
+typedef struct ConvEncoder
+{
+    unsigned int reg;       // last K-1 input bits, newest in the LSB
+    unsigned int bits;      // coded bits not yet written, LSB aligned
+    int bitCount;           // number of coded bits pending
+} ConvEncoder;
+
+typedef struct Viterbi
+{
+    unsigned int metric[CONVSTATES];    // path metric of every state
+    unsigned int decisions[TBLEN][CONVSTATES/32];   // survivor bits
+    int head;               // next slot in the decisions ring
+    int pending;            // steps in the ring not yet output
+    unsigned int errors;    // metric taken off by normalising
+    unsigned int bits;      // decoded bits not yet written to a char
+    int bitCount;           // number of decoded bits pending
+} Viterbi;
+
+typedef struct HammingCode
+{
+    int n;          // codeword bits, not counting the SECDED parity bit
+    int k;          // data bits
+    int secded;     // 1 if the overall parity bit is appended
+    int t;          // errors corrected per codeword
+    unsigned int generator; // BCH generator polynomial, 0 for Hamming
+} HammingCode;
+
+const HammingCode hammingCodes[HAMMINGCODES] = {{7, 4, 0, 1, 0},
+                                                {15, 11, 0, 1, 0},
+                                                {31, 26, 0, 1, 0},
+                                                {7, 4, 1, 1, 0},
+                                                {15, 11, 1, 1, 0},
+                                                {31, 26, 1, 1, 0},
+                                                {31, 21, 0, 2, 0x769},
+                                                {31, 16, 0, 3, 0x8FAF}};
+
+// Parity check matrix of the family in table form. Entry b of lane i is
+// the syndrome of byte b in bits 8i to 8i+7 of a codeword, so a syndrome
+// is four lookups XORed together. Generated by the preprocessor.
+#define LANEBIT(i,b,j) ((((b) >> (j)) & 1) ? 8*(i)+(j)+1 : 0)
+#define LANESYN(i,b) (LANEBIT(i,b,0) ^ LANEBIT(i,b,1) ^ LANEBIT(i,b,2) ^ \
+        LANEBIT(i,b,3) ^ LANEBIT(i,b,4) ^ LANEBIT(i,b,5) ^ \
+        LANEBIT(i,b,6) ^ LANEBIT(i,b,7))
+#define LANESYN4(i,b) LANESYN(i,b), LANESYN(i,(b)+1), LANESYN(i,(b)+2), \
+        LANESYN(i,(b)+3)
+#define LANESYN16(i,b) LANESYN4(i,b), LANESYN4(i,(b)+4), \
+        LANESYN4(i,(b)+8), LANESYN4(i,(b)+12)
+#define LANESYN64(i,b) LANESYN16(i,b), LANESYN16(i,(b)+16), \
+        LANESYN16(i,(b)+32), LANESYN16(i,(b)+48)
+#define LANESYN256(i) LANESYN64(i,0), LANESYN64(i,64), LANESYN64(i,128), \
+        LANESYN64(i,192)
+
+const unsigned char hammingLaneSyndrome[4][256] = {{LANESYN256(0)},
+                                                   {LANESYN256(1)},
+                                                   {LANESYN256(2)},
+                                                   {LANESYN256(3)}};
+
+// Even parity of every byte, for the SECDED overall parity bit
+#define BYTEPAR(b) (((b) ^ (b)>>1 ^ (b)>>2 ^ (b)>>3 ^ (b)>>4 ^ (b)>>5 ^ \
+        (b)>>6 ^ (b)>>7) & 1)
+#define BYTEPAR4(b) BYTEPAR(b), BYTEPAR((b)+1), BYTEPAR((b)+2), \
+        BYTEPAR((b)+3)
+#define BYTEPAR16(b) BYTEPAR4(b), BYTEPAR4((b)+4), BYTEPAR4((b)+8), \
+        BYTEPAR4((b)+12)
+#define BYTEPAR64(b) BYTEPAR16(b), BYTEPAR16((b)+16), BYTEPAR16((b)+32), \
+        BYTEPAR16((b)+48)
+
+const unsigned char byteParity[256] = {BYTEPAR64(0), BYTEPAR64(64),
+                                       BYTEPAR64(128), BYTEPAR64(192)};
+
+// Reads a message PACKETLEN bits at a time. Only the low seven bits of
+// every char are used since the ASCII MSB is always zero. Leftover bits are
+// kept between feeds so a message can arrive in any number of pieces.
+typedef struct BitReader
+{
+    const char *bfr;    // chunk currently being read
+    int len;            // chunk length in chars
+    int pos;            // next char of the chunk to load
+    unsigned int bits;  // loaded bits not yet read, LSB aligned
+    int bitCount;       // number of loaded bits
+} BitReader;
+
+// LED animation stepped from the main loop instead of waited out. Step i
+// lights the LEDs in pattern[i] for LEDSTEPMSEC.
+typedef struct LedAnimation
+{
+    const unsigned int *pattern;
+    int steps;
+    int step;               // step showing, steps once it is over
+    unsigned int stepAt;    // core timer tick the next step is due at
+} LedAnimation;
+
+// A new connection runs LED1 to LED3, a global reset flashes LED1 and a
+// transfer LED3
+const unsigned int ledConnect[3] = {BIT_0, BIT_1, BIT_2};
+const unsigned int ledReset[1] = {BIT_0};
+const unsigned int ledTransfer[1] = {BIT_2};
+
+void ledStart(LedAnimation *led, const unsigned int *pattern, int steps);
+void ledStep(LedAnimation *led);
+void hammingDecoder(char *recieveBuffer, int rlen, int decodeMode,
+        int *corrected, int *uncorrectable);
 void hammingEncoder(const char *myStr, char *tbfr, int tlen);
 char getPacket(const char *myStr, int packetNum, int packetSize);
 int divideDown(int a, int b);
 char getEncodeCodeword (char message);
 char getDecodeCodeword (char codeword);
 char hammingErrorDetectorCorrector(char codeword);
+void initHammingTables(void);
+char hammingTableDetectorCorrector(char codeword, int *corrected,
+        int *uncorrectable);
+int hammingBenchmark(const char *tbfr, int tlen, char *report);
+void bitReaderInit(BitReader *br);
+void bitReaderFeed(BitReader *br, const char *bfr, int len);
+int bitReaderRead(BitReader *br, int n, unsigned int *value);
+int hammingStreamEncode(BitReader *br, char *tbfr, int tbfrLen);
+int hammingStreamFlush(BitReader *br, char *tbfr);
+int hammingEncodeBenchmark(const char *myStr, char *report);
+int hammingStreamSend(SOCKET clientSock, BitReader *br, const char *bfr,
+        int len);
+int hammingPackFrame(const char *codewords, int n, char *frame);
+int hammingUnpackFrame(const char *frame, int len, char *codewords);
+int hammingMessageDecoder(const char *codewords, int n, char *msg);
+int replyFrame(char *reply, int msgLen, int corrected, int uncorrectable);
+unsigned int hammingCodeSyndrome(unsigned int codeword);
+unsigned int hammingCodeParity(unsigned int codeword);
+unsigned int hammingCodeEncode(const HammingCode *code, unsigned int data);
+unsigned int hammingCodeCorrect(const HammingCode *code, unsigned int codeword,
+        int *corrected, int *uncorrectable);
+int hammingCodeEncoder(int codeId, const char *msg, int len, char *frame);
+int hammingCodeDecoder(char *frame, int len, char *msg, int *corrected,
+        int *uncorrectable);
+unsigned int randPpm(void);
+int hammingCodeBenchmark(const char *myStr, char *report);
+void initBchTables(void);
+unsigned char gfMul(unsigned char a, unsigned char b);
+unsigned int bchEncode(const HammingCode *code, unsigned int data);
+unsigned int bchCorrect(const HammingCode *code, unsigned int codeword,
+        int *corrected, int *uncorrectable);
+int bchBenchmark(char *report);
+void convEncoderInit(ConvEncoder *ce);
+int convEncode(ConvEncoder *ce, const char *msg, int len, char *out);
+int convEncodeFlush(ConvEncoder *ce, char *out);
+void viterbiInit(Viterbi *v);
+int viterbiTraceback(Viterbi *v, int state, int steps, int keep, char *msg);
+int viterbiDecode(Viterbi *v, const char *in, int len, char *msg);
+int viterbiFlush(Viterbi *v, char *msg);
+int convBenchmark(const char *myStr, char *report);
+void transpose8(const unsigned char *in, unsigned char *out);
+unsigned int popCount(unsigned int x);
+void hammingBatchEncoder(const char *messages, char *codewords, int n);
+void hammingBatchDecoder(char *codewords, int n, int *corrected,
+        int *uncorrectable);
+int hammingBatchBenchmark(char *report);
+void interleave(const char *in, char *out, int rowLen, int depth);
+void deinterleave(const char *in, char *out, int rowLen, int depth);
+int interleaveFrame(const char *codewords, int n, int depth, char *frame);
+int deinterleaveFrame(const char *frame, int len, char *codewords);
+void burstChannel(char *bfr, int len);
+int interleaveBenchmark(const char *myStr, char *report);
+
+// Syndrome of every possible 6 bit codeword and the bit mask that corrects
+// each syndrome. Both are filled in once by initHammingTables().
+unsigned char hammingSyndromeTable[1 << CODEWORDLEN];
+unsigned char hammingCorrectTable[1 << PACKETLEN];
+
+// Codeword of every possible PACKETLEN bit message
+char hammingEncodeTable[1 << PACKETLEN];
+
+// Corrected PACKETLEN bit message of every possible codeword. Zero for
+// uncorrectable codewords to match the decoder.
+char hammingMessageTable[1 << CODEWORDLEN];
+
+// GF(2^5) antilog and log tables. gfExp is doubled up so the sum of two
+// logs never needs reducing.
+unsigned char gfExp[2*GFN];
+unsigned char gfLog[GFN+1];
+
+// Odd syndromes S1, S3 and S5 of a BCH codeword, one table per byte lane
+// like hammingLaneSyndrome. The even syndromes are squares of these.
+unsigned char bchSyndromeTable[BCHMAXT][4][256];
+
+// Coded symbol (G1 bit, G2 bit) for every K bit encoder register
+unsigned char convOutput[1 << CONVK];
 
 
 int main()
@@ -64,6 +375,32 @@ int main()
     // Initialize the Send/Recv buffers
     //
     char rbfr[256];
+    char report[1280];
+    char pbfr[MSGLEN+1];
+    char ibfr[MSGLEN+MAXDEPTH+INTERLEAVEHEADERLEN];
+    char cbfr[UNPACKLEN];
+    char dbfr[REPLYLEN];
+    char *codewords;
+    int clen, dlen;
+
+    // Stream encoder state. While streamEncoding is set everything the
+    // client sends is encoded and sent straight back until a '03'.
+    BitReader encodeReader;
+    int streamEncoding = 0;
+
+    // Convolutional code state for the '0284' transfer and its echo
+    ConvEncoder convEncoder;
+    Viterbi viterbi;
+
+    // Decoder selection and error counts of the last decoded message
+    int decodeMode = DECODETABLE;
+    int corrected, uncorrectable;
+
+    // LED animation the loop steps, and how long in core timer ticks the
+    // last client waited from accept until its first message was read
+    LedAnimation led = {NULL, 0, 0, 0};
+    unsigned int acceptedAt, setupTicks = 0;
+    int setupPending = 0;
 
     // Socket struct descriptor
     //
@@ -134,7 +471,10 @@ int main()
     tlen = MSGLEN;
     char tbfr[MSGLEN];
     
-    hammingEncoder(myStr, tbfr, tlen);
+    initHammingTables();
+    bitReaderInit(&encodeReader);
+    bitReaderFeed(&encodeReader, myStr, strlen(myStr));
+    hammingStreamEncode(&encodeReader, tbfr, tlen);
     // Loop forever
     //
     while (1) 
@@ -143,6 +483,7 @@ int main()
         //
         TCPIPProcess();
         DHCPTask();
+        ledStep(&led);
 
         // set the machines IP address and save to variable
         //
@@ -164,17 +505,14 @@ int main()
             //
             if (clientSock != INVALID_SOCKET) 
             {
+                acceptedAt = ReadCoreTimer();
+                setupPending = 1;
                 setsockopt(clientSock, SOL_SOCKET, TCP_NODELAY, 
                     (char*)&tlen, sizeof(int));
-                mPORTDSetBits(BIT_0); // LED1=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_0); // LED1=0
-                mPORTDSetBits(BIT_1); // LED2=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_1); // LED2=0
-                mPORTDSetBits(BIT_2); // LED3=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_2); // LED3=0
+                ledStart(&led, ledConnect, 3);
+#if LEDBLOCKING
+                while (led.step < led.steps) ledStep(&led);
+#endif
             }
         } else 
         {
@@ -188,18 +526,32 @@ int main()
             //
             if (rlen > 0) 
             {
+                // The first message read ends the connection setup
+                if (setupPending)
+                {
+                    setupTicks = ReadCoreTimer() - acceptedAt;
+                    setupPending = 0;
+                }
+
+                // A stream encode is in progress so the message is more
+                // payload. Encode it up to the '03' end of message.
+                if (streamEncoding)
+                {
+                    streamEncoding = hammingStreamSend(clientSock,
+                            &encodeReader, rbfr, rlen);
+                }
                 // If the received message first byte is '02' it signifies
                 // a start of message
                 //
-                if (rbfr[0] == 2) 
+                else if (rbfr[0] == 2) 
                 {
+                    mPORTDClearBits(BIT_0); // LED1=0
+
                     // Check to see if message begins with
                     // '0271' signifying message is a global reset
                     if (rbfr[1] == 71) 
                     {
-                        mPORTDSetBits(BIT_0); // LED1=1
-                        DelayMsec(50);
-                        mPORTDClearBits(BIT_0); // LED1=0
+                        ledStart(&led, ledReset, 1);
                     }
                     // Check to see if message begins with 
                     // '0284' signifying message is a start of a transfer
@@ -207,23 +559,191 @@ int main()
                     {
                         mPORTDClearBits(BIT_0);
                         mPORTDSetBits(BIT_2);   // LED3=1
-                        send(clientSock, tbfr, tlen, 0);
-                        DelayMsec(50);
+
+                        // A third byte asks for a wire format header. 
+                        // Without one we send the bare codewords.
+                        if (rlen > 2 && 
+                                (unsigned char)rbfr[2] == (WIRECODED | CONVK7))
+                        {
+                            // Same message through the convolutional code
+                            rbfr[0] = WIRECODED | CONVK7;
+                            convEncoderInit(&convEncoder);
+                            rlen = 1 + convEncode(&convEncoder, myStr, 
+                                    strlen(myStr), rbfr+1);
+                            rlen += convEncodeFlush(&convEncoder, rbfr+rlen);
+                            send(clientSock, rbfr, rlen, 0);
+                        }
+                        // Codewords through the bit interleaver. The
+                        // fourth byte is the depth. A request without one
+                        // or with a depth interleaveFrame cannot use is
+                        // ignored.
+                        else if (rlen > 2 &&
+                                (unsigned char)rbfr[2] == WIREINTERLEAVED)
+                        {
+                            if (rlen > 3 && rbfr[3] >= 8 && 
+                                    rbfr[3] <= MAXDEPTH && (rbfr[3] & 7) == 0)
+                            {
+                                send(clientSock, ibfr, interleaveFrame(tbfr, 
+                                        tlen, rbfr[3], ibfr), 0);
+                            }
+                        }
+                        else if (rlen > 2 && 
+                                (rbfr[2] & WIREHEADERMASK) == WIREPACKED)
+                        {
+                            send(clientSock, pbfr, 
+                                hammingPackFrame(tbfr, tlen, pbfr), 0);
+                        }
+                        else if (rlen > 2 && 
+                                (rbfr[2] & WIREHEADERMASK) == WIREUNPACKED)
+                        {
+                            pbfr[0] = WIREUNPACKED;
+                            memcpy(pbfr+1, tbfr, tlen);
+                            send(clientSock, pbfr, tlen+1, 0);
+                        }
+                        // Any other code header is not a format we send
+                        // and gets nothing back
+                        else if (rlen <= 2 || 
+                                (rbfr[2] & WIREHEADERMASK) == 0)
+                        {
+                            send(clientSock, tbfr, tlen, 0);
+                        }
+                        ledStart(&led, ledTransfer, 1);
+                    }
+                    // Check to see if message begins with
+                    // '0277' signifying a decoder mode change. The third
+                    // byte selects the decoder.
+                    else if(rbfr[1]==77 && rlen > 2)
+                    {
+                        if (rbfr[2] == DECODELEGACY)
+                            decodeMode = DECODELEGACY;
+                        else if (rbfr[2] == DECODEBATCH)
+                            decodeMode = DECODEBATCH;
+                        else decodeMode = DECODETABLE;
+                    }
+                    // Check to see if message begins with
+                    // '0266' signifying a decoder benchmark request. The
+                    // results are sent back as text.
+                    else if(rbfr[1]==66)
+                    {
+                        mPORTDSetBits(BIT_2);   // LED3=1
+                        rlen = hammingBenchmark(tbfr, tlen, report);
+                        rlen += hammingEncodeBenchmark(myStr, report+rlen);
+                        rlen += hammingCodeBenchmark(myStr, report+rlen);
+                        rlen += hammingBatchBenchmark(report+rlen);
+                        rlen += bchBenchmark(report+rlen);
+                        rlen += convBenchmark(myStr, report+rlen);
+                        rlen += interleaveBenchmark(myStr, report+rlen);
+                        rlen += sprintf(report+rlen, "setup-us\r\n%u\r\n",
+                                setupTicks/(TICKSPERMSEC/1000));
+                        send(clientSock, report, rlen, 0);
+                        mPORTDClearBits(BIT_2);	// LED3=0
+                    }
+                    // Check to see if message begins with
+                    // '0269' signifying the start of a stream encode. Any
+                    // bytes after the command are the first of the payload.
+                    else if(rbfr[1]==69)
+                    {
+                        bitReaderInit(&encodeReader);
+                        streamEncoding = hammingStreamSend(clientSock,
+                                &encodeReader, rbfr+2, rlen-2);
+                    }
+                    // Check to see if message begins with
+                    // '0267' signifying a transfer with one of the
+                    // hammingCodes. The third byte selects the code.
+                    else if(rbfr[1]==67 && rlen > 2 && 
+                            rbfr[2] >= 0 && rbfr[2] < HAMMINGCODES)
+                    {
+                        mPORTDSetBits(BIT_2);   // LED3=1
+                        rlen = hammingCodeEncoder(rbfr[2], myStr, 
+                                strlen(myStr), rbfr);
+                        send(clientSock, rbfr, rlen, 0);
                         mPORTDClearBits(BIT_2);	// LED3=0
                     }
-                mPORTDClearBits(BIT_0); // LED1=0
                 }
                 // If not prefixed we say client is sending back our
                 // transmits corrupted packet.
                 else
                 {
-                    // receive possible corrupted data
-                    hammingDecoder(rbfr, rlen);
+                    // Convolutional frames go through the Viterbi decoder.
+                    // The channel errors it corrected are the metric of
+                    // the surviving path.
+                    if ((unsigned char)rbfr[0] == (WIRECODED | CONVK7))
+                    {
+                        viterbiInit(&viterbi);
+                        dlen = viterbiDecode(&viterbi, rbfr+1, rlen-1, 
+                                dbfr+REPLYHEADERLEN);
+                        dlen += viterbiFlush(&viterbi, 
+                                dbfr+REPLYHEADERLEN+dlen);
+                        corrected = viterbi.errors;
+                        uncorrectable = 0;
+                    }
+                    // Frames of the code family are corrected in place
+                    // and decoded in one go
+                    else if ((rbfr[0] & WIREHEADERMASK) == WIRECODED &&
+                            (unsigned char)rbfr[0] != WIREINTERLEAVED)
+                    {
+                        dlen = hammingCodeDecoder(rbfr, rlen, 
+                                dbfr+REPLYHEADERLEN, &corrected, 
+                                &uncorrectable);
+                    }
+                    else
+                    {
+                        // receive possible corrupted data. A packed or
+                        // interleaved frame is spread back out to one 
+                        // codeword per char first.
+                        if ((unsigned char)rbfr[0] == WIREINTERLEAVED)
+                        {
+                            clen = deinterleaveFrame(rbfr, rlen, cbfr);
+                            codewords = cbfr;
+                        }
+                        else if ((rbfr[0] & WIREHEADERMASK) == WIREPACKED)
+                        {
+                            clen = hammingUnpackFrame(rbfr, rlen, cbfr);
+                            codewords = cbfr;
+                        }
+                        else if ((rbfr[0] & WIREHEADERMASK) == WIREUNPACKED)
+                        {
+                            clen = rlen-1;
+                            codewords = rbfr+1;
+                        }
+                        else
+                        {
+                            clen = rlen;
+                            codewords = rbfr;
+                        }
+                        hammingDecoder(codewords, clen, decodeMode, 
+                                &corrected, &uncorrectable);
+
+                        // Pack or interleave the corrected codewords 
+                        // again for the echo
+                        if ((unsigned char)rbfr[0] == WIREINTERLEAVED)
+                        {
+                            rlen = interleaveFrame(cbfr, clen, rbfr[1], rbfr);
+                        }
+                        else if (codewords == cbfr)
+                        {
+                            rlen = hammingPackFrame(cbfr, clen, rbfr);
+                        }
+                        dlen = hammingMessageDecoder(codewords, clen, 
+                                dbfr+REPLYHEADERLEN);
+                    }
+
+                    // Signal the outcome once per message instead of once
+                    // per corrected byte. LED2 (yellow) shows corrected
+                    // errors, LED1 (red) shows uncorrectable ones.
+                    if (corrected > 0) mPORTDSetBits(BIT_1);
+                    else mPORTDClearBits(BIT_1);
+                    if (uncorrectable > 0) mPORTDSetBits(BIT_0);
+                    else mPORTDClearBits(BIT_0);
 
                     //send data back across the socket 
                     // (for viewing in wireshark)
                     mPORTDSetBits(BIT_2);   // LED3=1
                     send(clientSock, rbfr, rlen, 0);
+
+                    // Follow the echo with the recovered message
+                    send(clientSock, dbfr, replyFrame(dbfr, dlen, corrected,
+                            uncorrectable), 0);
                     mPORTDClearBits(BIT_2);   // LED3=1
                 }
                 // The client has closed the socket so we close as well
@@ -233,33 +753,75 @@ int main()
             {
                     closesocket(clientSock);
                     clientSock = SOCKET_ERROR;
+
+                    // A stream the client left unfinished ends with it, so
+                    // the next client's commands are not taken as payload
+                    streamEncoding = 0;
+                    bitReaderInit(&encodeReader);
             }
         }   
     }
 }
 
-// Function : DelayMsec( )
-// 
-// Delays the program by specified millisecond passed
-void DelayMsec(unsigned int msec) 
+// Starts led over with pattern, cutting short any animation still showing
+void ledStart(LedAnimation *led, const unsigned int *pattern, int steps)
 {
-    unsigned int tWait, tStart;
-    tWait = (SYS_FREQ / 2000) * msec;
-    tStart = ReadCoreTimer();
-    while ((ReadCoreTimer() - tStart) < tWait);
+    if (led->step < led->steps) mPORTDClearBits(led->pattern[led->step]);
+    led->pattern = pattern;
+    led->steps = steps;
+    led->step = 0;
+    led->stepAt = ReadCoreTimer() + LEDSTEPMSEC*TICKSPERMSEC;
+    mPORTDSetBits(pattern[0]);
+}
+
+// Moves led to its next step once the one showing is up and clears the
+// LEDs after the last. Returns at once otherwise.
+void ledStep(LedAnimation *led)
+{
+    if (led->step == led->steps) return;
+    if ((int)(ReadCoreTimer() - led->stepAt) < 0) return;
+    mPORTDClearBits(led->pattern[led->step]);
+    led->step++;
+    if (led->step < led->steps)
+    {
+        mPORTDSetBits(led->pattern[led->step]);
+        led->stepAt += LEDSTEPMSEC*TICKSPERMSEC;
+    }
 }
 
-void hammingDecoder(char *recieveBuffer, int rlen)
+void hammingDecoder(char *recieveBuffer, int rlen, int decodeMode,
+        int *corrected, int *uncorrectable)
 {
     int i;
-    char codewordResized = 0x00;
-    char receievedMessage;
-    char z = 0x00;
+    char codeword;
+
+    *corrected = 0;
+    *uncorrectable = 0;
+
+    // The table decoder keeps the per byte work to two lookups and an XOR
+    if (decodeMode == DECODEBATCH)
+    {
+        hammingBatchDecoder(recieveBuffer, rlen, corrected, uncorrectable);
+        return;
+    }
+    if (decodeMode == DECODETABLE)
+    {
+        for(i=0; i < rlen; i++)
+        {
+            recieveBuffer[i] = hammingTableDetectorCorrector(recieveBuffer[i],
+                    corrected, uncorrectable);
+        }
+        return;
+    }
 
     for(i=0; i < rlen; i++)
     {
-        recieveBuffer[i] = hammingErrorDetectorCorrector(recieveBuffer[i]);
-        receievedMessage = getDecodeCodeword(z); 
+        codeword = recieveBuffer[i];
+        recieveBuffer[i] = hammingErrorDetectorCorrector(codeword);
+
+        // The legacy decoder does not count errors so we classify the
+        // codeword with the tables
+        hammingTableDetectorCorrector(codeword, corrected, uncorrectable);
     }
 }
 
@@ -401,68 +963,47 @@ char hammingErrorDetectorCorrector(char codeword)
     if (syndrome != 0x00)
     {
         // if non-zero we say we have an error. We check to see if we can
-        // correct the codeword.
-        // Set led 1 (red) high
-        mPORTDSetBits(BIT_1);
-        DelayMsec(100);
+        // correct the codeword. The caller shows the outcome on the LEDs
+        // once per message.
         // Bit 5 an error
         if (syndrome == 0b00000110) 
         {
-            // Reset LED saying we fixed the error
-            mPORTDClearBits(BIT_1);
-            DelayMsec(100);
             codeword ^= 0x01 << 5;
         }
 
         // Bit 4 an error
         else if (syndrome == 0b00000111)
         {
-            // Reset LED saying we fixed the error
-            mPORTDClearBits(BIT_1);
-            DelayMsec(100);
             codeword ^= 0x01 << 4;
         }
         
         // Bit 3 an error
         else if (syndrome == 0b00000101)
         {
-            // Reset LED saying we fixed the error
-            mPORTDClearBits(BIT_1);
-            DelayMsec(100);
             codeword ^= 0x01 << 3;
         }
 
         // Bit 2 an error
         else if (syndrome == 0b00000100)
         {
-            // Reset LED saying we fixed the error
-            mPORTDClearBits(BIT_1);
-            DelayMsec(100);
             codeword ^= 0x01 << 2;
         }
 
         // Bit 1 an error
         else if (syndrome == 0b00000010)
         {
-            // Reset LED saying we fixed the error
-            mPORTDClearBits(BIT_1);
-            DelayMsec(100);
             codeword ^= 0x01 << 1;
         }
 
         // Bit 0 an error
         else if (syndrome == 0b00000001)
         {
-            // Reset LED saying we fixed the error
-            mPORTDClearBits(BIT_1);
-            DelayMsec(100);
             codeword ^= 0x01 << 0;
         }
 
         // Otherwise there is an uncorrectable error. We set to zero
         // for analysis purposes.
         else{
-            mPORTDSetBits(BIT_0);
             codeword = 0x00;
         } 
 
@@ -470,3 +1011,1594 @@ char hammingErrorDetectorCorrector(char codeword)
     return codeword;
 
 }
+
+// Fills in the syndrome and correction tables from the parity check matrix.
+// Runs once at start up so the decoder never does matrix math per byte.
+void initHammingTables(void)
+{
+    // Parity Check Matrix (same as hammingErrorDetectorCorrector)
+    int H[CODEWORDLEN][PACKETLEN] = {{1, 1, 0},
+                                     {1, 1, 1},
+                                     {1, 0, 1},
+                                     {1, 0, 0},
+                                     {0, 1, 0},
+                                     {0, 0, 1}};
+    int codeword, i, j;
+    int corrected, uncorrectable;
+    unsigned char syndrome;
+
+    // Without a matching column a syndrome can not be corrected
+    for(i=0; i < (1 << PACKETLEN); i++)
+    {
+        hammingCorrectTable[i] = UNCORRECTABLE;
+    }
+    hammingCorrectTable[0] = 0x00;
+
+    for(codeword=0; codeword < (1 << CODEWORDLEN); codeword++)
+    {
+        syndrome = 0x00;
+        for(i=0; i < CODEWORDLEN; i++)
+        {
+            // Each set codeword bit adds its row of H to the syndrome
+            if (codeword & (0x01 << (CODEWORDLEN-1-i)))
+            {
+                for(j=0; j < PACKETLEN; j++)
+                {
+                    syndrome ^= H[i][j] << (PACKETLEN-1-j);
+                }
+            }
+        }
+        hammingSyndromeTable[codeword] = syndrome;
+
+        // A single bit codeword has the syndrome of the bit in error
+        for(i=0; i < CODEWORDLEN; i++)
+        {
+            if (codeword == (0x01 << i)) hammingCorrectTable[syndrome] = i;
+        }
+    }
+
+    // Turn bit positions into correction masks
+    for(i=1; i < (1 << PACKETLEN); i++)
+    {
+        if (hammingCorrectTable[i] != UNCORRECTABLE)
+        {
+            hammingCorrectTable[i] = 0x01 << hammingCorrectTable[i];
+        }
+    }
+
+    // Every message only has to go through the generator matrix once
+    for(i=0; i < (1 << PACKETLEN); i++)
+    {
+        hammingEncodeTable[i] = getEncodeCodeword(i);
+    }
+
+    initBchTables();
+
+    // Likewise every codeword only goes through correction and the
+    // decode matrix once
+    for(codeword=0; codeword < (1 << CODEWORDLEN); codeword++)
+    {
+        hammingMessageTable[codeword] = getDecodeCodeword(
+                hammingTableDetectorCorrector(codeword, &corrected,
+                        &uncorrectable));
+    }
+}
+
+// Table driven version of hammingErrorDetectorCorrector. Corrects a single
+// bit error and zeroes an uncorrectable codeword, counting both instead of
+// signalling on the LEDs.
+char hammingTableDetectorCorrector(char codeword, int *corrected,
+        int *uncorrectable)
+{
+    unsigned char syndrome;
+    unsigned char mask;
+
+    syndrome = hammingSyndromeTable[codeword & ((1 << CODEWORDLEN)-1)];
+    if (syndrome == 0x00) return codeword;
+
+    mask = hammingCorrectTable[syndrome];
+    if (mask == UNCORRECTABLE)
+    {
+        (*uncorrectable)++;
+        return 0x00;
+    }
+    (*corrected)++;
+    return codeword ^ mask;
+}
+
+// Times the legacy and the table decoder with the core timer and writes a
+// text report into report. Returns the report length. The core timer runs
+// at half the system clock so every tick is two CPU cycles.
+int hammingBenchmark(const char *tbfr, int tlen, char *report)
+{
+    char bfr[MSGLEN];
+    unsigned int tStart;
+    unsigned int legacyClean, tableClean, legacyError, tableError;
+    int corrected, uncorrectable;
+    int i;
+
+    // Error free message. The legacy decoder only does matrix math here.
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        memcpy(bfr, tbfr, tlen);
+        hammingDecoder(bfr, tlen, DECODELEGACY, &corrected, &uncorrectable);
+    }
+    legacyClean = ReadCoreTimer() - tStart;
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        memcpy(bfr, tbfr, tlen);
+        hammingDecoder(bfr, tlen, DECODETABLE, &corrected, &uncorrectable);
+    }
+    tableClean = ReadCoreTimer() - tStart;
+
+    // One bit in error in the first codeword
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        memcpy(bfr, tbfr, tlen);
+        bfr[0] ^= 0x01;
+        hammingDecoder(bfr, tlen, DECODELEGACY, &corrected, &uncorrectable);
+    }
+    legacyError = ReadCoreTimer() - tStart;
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        memcpy(bfr, tbfr, tlen);
+        bfr[0] ^= 0x01;
+        hammingDecoder(bfr, tlen, DECODETABLE, &corrected, &uncorrectable);
+    }
+    tableError = ReadCoreTimer() - tStart;
+
+    return sprintf(report, "cycles/byte clean legacy=%u table=%u "
+            "1err legacy=%u table=%u\r\n",
+            2*legacyClean/(BENCHREPS*tlen), 2*tableClean/(BENCHREPS*tlen),
+            2*legacyError/(BENCHREPS*tlen), 2*tableError/(BENCHREPS*tlen));
+}
+
+// Empties the bit reader for the start of a new message
+void bitReaderInit(BitReader *br)
+{
+    br->bfr = NULL;
+    br->len = 0;
+    br->pos = 0;
+    br->bits = 0;
+    br->bitCount = 0;
+}
+
+// Hands the next chunk of the message to the bit reader. Bits left over
+// from the previous chunk are read first.
+void bitReaderFeed(BitReader *br, const char *bfr, int len)
+{
+    br->bfr = bfr;
+    br->len = len;
+    br->pos = 0;
+}
+
+// Reads the next n bits (n <= 26) of the message into value. Returns 0
+// and leaves the bits in place if the chunk runs out first.
+int bitReaderRead(BitReader *br, int n, unsigned int *value)
+{
+    // Load whole chars until we have enough bits
+    while (br->bitCount < n)
+    {
+        if (br->pos >= br->len) return 0;
+        br->bits = (br->bits << 7) | (br->bfr[br->pos++] & 0x7F);
+        br->bitCount += 7;
+    }
+    br->bitCount -= n;
+    *value = (br->bits >> br->bitCount) & ((1u << n)-1);
+    br->bits &= (1u << br->bitCount)-1;
+    return 1;
+}
+
+// Encodes as many whole packets of the fed chunk as fit in tbfrLen
+// codewords. Returns the number of codewords written, zero once the chunk
+// is used up.
+int hammingStreamEncode(BitReader *br, char *tbfr, int tbfrLen)
+{
+    int i;
+    unsigned int message;
+
+    for(i=0; i < tbfrLen; i++)
+    {
+        if (!bitReaderRead(br, PACKETLEN, &message)) break;
+        tbfr[i] = hammingEncodeTable[message];
+    }
+    return i;
+}
+
+// Encodes the bits left at the end of the message, padded out to a whole
+// packet with zeros. Returns the number of codewords written.
+int hammingStreamFlush(BitReader *br, char *tbfr)
+{
+    char message;
+
+    if (br->bitCount == 0) return 0;
+    message = (br->bits << (PACKETLEN - br->bitCount)) & ((1 << PACKETLEN)-1);
+    br->bits = 0;
+    br->bitCount = 0;
+    tbfr[0] = hammingEncodeTable[(int)message];
+    return 1;
+}
+
+// Encodes the next piece of a streamed message and sends the codewords to
+// the client ENCODECHUNK at a time, so the whole message never has to be
+// in memory. Returns 0 once the '03' end of message has been seen and the
+// last packet flushed, otherwise 1.
+int hammingStreamSend(SOCKET clientSock, BitReader *br, const char *bfr,
+        int len)
+{
+    char ebfr[ENCODECHUNK];
+    int elen, end;
+
+    for(end=0; end < len && bfr[end] != 3; end++);
+
+    mPORTDSetBits(BIT_2);   // LED3=1
+    bitReaderFeed(br, bfr, end);
+    while ((elen = hammingStreamEncode(br, ebfr, ENCODECHUNK)) > 0)
+    {
+        send(clientSock, ebfr, elen, 0);
+    }
+    mPORTDClearBits(BIT_2);	// LED3=0
+
+    if (end == len) return 1;
+
+    // Pad out the last packet now that the message is over
+    elen = hammingStreamFlush(br, ebfr);
+    if (elen > 0) send(clientSock, ebfr, elen, 0);
+    return 0;
+}
+
+// Times the legacy and the stream encoder on a BENCHMSGLEN char message
+// built from myStr and appends the throughput of each to report in MB/s.
+// Returns the number of chars appended.
+int hammingEncodeBenchmark(const char *myStr, char *report)
+{
+    char msg[BENCHMSGLEN];
+    char bfr[BENCHMSGLEN*7/PACKETLEN];
+    int blen = BENCHMSGLEN*7/PACKETLEN;
+    unsigned int tStart, legacyTicks, streamTicks;
+    unsigned int legacyKBps, streamKBps;
+    int i, slen;
+    BitReader br;
+
+    // Repeat the message until the buffer is full
+    slen = strlen(myStr);
+    for(i=0; i < BENCHMSGLEN; i++)
+    {
+        msg[i] = myStr[i % slen];
+    }
+
+    tStart = ReadCoreTimer();
+    hammingEncoder(msg, bfr, blen);
+    legacyTicks = ReadCoreTimer() - tStart;
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BENCHREPS; i++)
+    {
+        bitReaderInit(&br);
+        bitReaderFeed(&br, msg, BENCHMSGLEN);
+        hammingStreamEncode(&br, bfr, blen);
+    }
+    streamTicks = ReadCoreTimer() - tStart;
+
+    // The core timer ticks SYS_FREQ/2 times a second
+    legacyKBps = (unsigned int)((unsigned long long)BENCHMSGLEN*(SYS_FREQ/2)
+            / (legacyTicks ? legacyTicks : 1) / 1000);
+    streamKBps = (unsigned int)((unsigned long long)BENCHMSGLEN*BENCHREPS
+            *(SYS_FREQ/2) / (streamTicks ? streamTicks : 1) / 1000);
+
+    return sprintf(report, "encode MB/s legacy=%u.%03u stream=%u.%03u\r\n",
+            legacyKBps/1000, legacyKBps%1000,
+            streamKBps/1000, streamKBps%1000);
+}
+
+// Writes a packed wire frame of n codewords into frame: a WIREPACKED
+// header followed by the codewords laid end to end, MSB first, four to
+// every three bytes. Returns the frame length.
+int hammingPackFrame(const char *codewords, int n, char *frame)
+{
+    unsigned int bits = 0;
+    int bitCount = 0;
+    int i, len = 1;
+
+    for(i=0; i < n; i++)
+    {
+        bits = (bits << CODEWORDLEN) | (codewords[i] & ((1 << CODEWORDLEN)-1));
+        bitCount += CODEWORDLEN;
+        while (bitCount >= 8)
+        {
+            bitCount -= 8;
+            frame[len++] = bits >> bitCount;
+        }
+    }
+
+    // Pad out the last byte with zeros and record how many we added
+    if (bitCount > 0)
+    {
+        frame[len++] = bits << (8 - bitCount);
+        frame[0] = WIREPACKED | (8 - bitCount);
+    }
+    else
+    {
+        frame[0] = WIREPACKED;
+    }
+    return len;
+}
+
+// Spreads a packed wire frame back out to one codeword per char. Returns
+// the number of codewords written.
+int hammingUnpackFrame(const char *frame, int len, char *codewords)
+{
+    unsigned int bits = 0;
+    int bitCount = 0;
+    int i, n = 0;
+    int total;
+
+    // Only whole codewords were packed, the rest is padding
+    total = ((len-1)*8 - (frame[0] & WIREPADMASK)) / CODEWORDLEN;
+
+    for(i=1; i < len && n < total; i++)
+    {
+        bits = (bits << 8) | (unsigned char)frame[i];
+        bitCount += 8;
+        while (bitCount >= CODEWORDLEN && n < total)
+        {
+            bitCount -= CODEWORDLEN;
+            codewords[n++] = (bits >> bitCount) & ((1 << CODEWORDLEN)-1);
+        }
+    }
+    return n;
+}
+
+// Corrects and decodes n codewords and packs the PACKETLEN bit messages
+// back into the 7 bit ASCII chars getPacket split them out of. Trailing
+// bits short of a whole char are the encoder's padding and are dropped.
+// Returns the number of chars written to msg.
+int hammingMessageDecoder(const char *codewords, int n, char *msg)
+{
+    unsigned int bits = 0;
+    int bitCount = 0;
+    int i, len = 0;
+
+    for(i=0; i < n; i++)
+    {
+        bits = (bits << PACKETLEN) |
+            hammingMessageTable[codewords[i] & ((1 << CODEWORDLEN)-1)];
+        bitCount += PACKETLEN;
+        if (bitCount >= 7)
+        {
+            bitCount -= 7;
+            msg[len++] = (bits >> bitCount) & 0x7F;
+        }
+    }
+    return len;
+}
+
+// Wraps the msgLen chars already decoded at reply+REPLYHEADERLEN into the
+// reply for the client: '02', the corrected and uncorrectable counts, the
+// decoded message and '03'. Returns the reply length.
+int replyFrame(char *reply, int msgLen, int corrected, int uncorrectable)
+{
+    reply[0] = 2;
+    reply[1] = corrected >> 8;
+    reply[2] = corrected;
+    reply[3] = uncorrectable >> 8;
+    reply[4] = uncorrectable;
+    reply[REPLYHEADERLEN+msgLen] = 3;
+    return REPLYHEADERLEN + msgLen + 1;
+}
+
+// Syndrome of a codeword of any code in the family
+unsigned int hammingCodeSyndrome(unsigned int codeword)
+{
+    return hammingLaneSyndrome[0][codeword & 0xFF] ^
+           hammingLaneSyndrome[1][(codeword >> 8) & 0xFF] ^
+           hammingLaneSyndrome[2][(codeword >> 16) & 0xFF] ^
+           hammingLaneSyndrome[3][codeword >> 24];
+}
+
+// Even parity of all 32 bits of a codeword
+unsigned int hammingCodeParity(unsigned int codeword)
+{
+    return byteParity[codeword & 0xFF] ^ byteParity[(codeword >> 8) & 0xFF] ^
+           byteParity[(codeword >> 16) & 0xFF] ^ byteParity[codeword >> 24];
+}
+
+// Encodes k data bits. The data is spread over the non power of two
+// positions and the syndrome of that is written into the parity positions,
+// which leaves the codeword with a zero syndrome.
+unsigned int hammingCodeEncode(const HammingCode *code, unsigned int data)
+{
+    unsigned int codeword, syndrome;
+
+    if (code->generator) return bchEncode(code, data);
+
+    data &= (1u << code->k)-1;
+    codeword = ((data & 0x1) << 2) | ((data & 0xE) << 3) |
+               ((data & 0x7F0) << 4) | ((data & 0x3FFF800) << 5);
+
+    // Parity positions 1, 2, 4, 8 and 16 are bits 0, 1, 3, 7 and 15
+    syndrome = hammingCodeSyndrome(codeword);
+    codeword |= (syndrome & 0x3) | ((syndrome & 0x4) << 1) |
+                ((syndrome & 0x8) << 4) | ((syndrome & 0x10) << 11);
+
+    if (code->secded) codeword |= hammingCodeParity(codeword) << code->n;
+    return codeword;
+}
+
+// Corrects a single bit error in a codeword and returns its data bits.
+// SECDED codes also detect double errors, which are counted as
+// uncorrectable and decode to zero like the (6,3) decoder.
+unsigned int hammingCodeCorrect(const HammingCode *code, unsigned int codeword,
+        int *corrected, int *uncorrectable)
+{
+    unsigned int syndrome;
+
+    if (code->generator)
+    {
+        return bchCorrect(code, codeword, corrected, uncorrectable);
+    }
+
+    // The SECDED parity bit sits at position n+1 and n is all ones, so
+    // masking with n leaves just the Hamming syndrome
+    syndrome = hammingCodeSyndrome(codeword) & code->n;
+
+    if (code->secded)
+    {
+        if (hammingCodeParity(codeword))
+        {
+            // Odd parity is a single error, a zero syndrome puts it in the
+            // overall parity bit which carries no data
+            if (syndrome != 0) codeword ^= 1u << (syndrome-1);
+            (*corrected)++;
+        }
+        else if (syndrome != 0)
+        {
+            (*uncorrectable)++;
+            return 0;
+        }
+    }
+    else if (syndrome != 0)
+    {
+        codeword ^= 1u << (syndrome-1);
+        (*corrected)++;
+    }
+
+    return (((codeword >> 2) & 0x1) | ((codeword >> 3) & 0xE) |
+            ((codeword >> 4) & 0x7F0) | ((codeword >> 5) & 0x3FFF800)) &
+           ((1u << code->k)-1);
+}
+
+// Encodes msg with hammingCodes[codeId] into a WIRECODED frame. Codewords
+// are written MSB first in the fewest whole bytes that hold them and the
+// last block is padded with zeros. Returns the frame length.
+int hammingCodeEncoder(int codeId, const char *msg, int len, char *frame)
+{
+    const HammingCode *code = &hammingCodes[codeId];
+    int bytes = (code->n + code->secded + 7)/8;
+    int flen = CODEDHEADERLEN;
+    int i;
+    unsigned int data, codeword;
+    BitReader br;
+
+    frame[0] = WIRECODED | codeId;
+    frame[1] = len >> 8;
+    frame[2] = len;
+
+    bitReaderInit(&br);
+    bitReaderFeed(&br, msg, len);
+    while (1)
+    {
+        // Out of whole blocks, pad the leftover bits
+        if (!bitReaderRead(&br, code->k, &data))
+        {
+            if (br.bitCount == 0) break;
+            data = br.bits << (code->k - br.bitCount);
+            br.bits = 0;
+            br.bitCount = 0;
+        }
+        codeword = hammingCodeEncode(code, data);
+        for(i=bytes-1; i >= 0; i--)
+        {
+            frame[flen++] = codeword >> (8*i);
+        }
+    }
+    return flen;
+}
+
+// Corrects the codewords of a WIRECODED frame in place and decodes them
+// into 7 bit ASCII chars. Decoding stops at the char count in the header,
+// anything after it is padding. Returns the number of chars written to
+// msg.
+int hammingCodeDecoder(char *frame, int len, char *msg, int *corrected,
+        int *uncorrectable)
+{
+    const HammingCode *code;
+    int codeId = frame[0] & WIREPADMASK;
+    int bytes, chars;
+    int i, j, mlen = 0;
+    unsigned int codeword, data;
+    unsigned int bits = 0;
+    int bitCount = 0;
+
+    *corrected = 0;
+    *uncorrectable = 0;
+    if (codeId >= HAMMINGCODES || len < CODEDHEADERLEN) return 0;
+
+    code = &hammingCodes[codeId];
+    bytes = (code->n + code->secded + 7)/8;
+    chars = ((unsigned char)frame[1] << 8) | (unsigned char)frame[2];
+
+    for(i=CODEDHEADERLEN; i+bytes <= len; i+=bytes)
+    {
+        codeword = 0;
+        for(j=0; j < bytes; j++)
+        {
+            codeword = (codeword << 8) | (unsigned char)frame[i+j];
+        }
+        data = hammingCodeCorrect(code, codeword, corrected, uncorrectable);
+
+        // Write the corrected codeword back for the echo
+        codeword = hammingCodeEncode(code, data);
+        for(j=0; j < bytes; j++)
+        {
+            frame[i+j] = codeword >> (8*(bytes-1-j));
+        }
+
+        // At most 6 bits are left over from the last block so a 26 bit
+        // block still fits in the accumulator
+        bits = (bits << code->k) | data;
+        bitCount += code->k;
+        while (bitCount >= 7 && mlen < chars)
+        {
+            bitCount -= 7;
+            msg[mlen++] = (bits >> bitCount) & 0x7F;
+        }
+    }
+    return mlen;
+}
+
+// Uniform random number from 0 to 999999. rand() only goes up to 32767
+// on the PIC32 so it takes two draws. Every simulated channel draws its
+// per bit error chance from here.
+unsigned int randPpm(void)
+{
+    return (rand() % 1000)*1000 + rand() % 1000;
+}
+
+// Encodes a BENCHMSGLEN char message with the (6,3) code and every code of
+// the family, sends it through a channel flipping bits with BENCHBERPPM
+// chance drawn from randPpm and times the decode. Appends a table of code
+// rate, decode throughput and residual bit error rate to report. Returns
+// the number of chars appended.
+int hammingCodeBenchmark(const char *myStr, char *report)
+{
+    char msg[BENCHMSGLEN];
+    char frame[BENCHMSGLEN*7/PACKETLEN+1];
+    char rx[BENCHMSGLEN*7/PACKETLEN+1];
+    char decoded[REPLYLEN];
+    unsigned int tStart, ticks, kBps;
+    int corrected, uncorrectable;
+    int codeId, flen, dlen, errors;
+    unsigned char diff;
+    int i, j, len = 0;
+    BitReader br;
+
+    // Repeat the message until the buffer is full
+    for(i=0; i < BENCHMSGLEN; i++)
+    {
+        msg[i] = myStr[i % strlen(myStr)];
+    }
+
+    len += sprintf(report+len, "code rate%% MB/s residual-ppm\r\n");
+
+    // codeId -1 is the (6,3) code, one codeword per char
+    srand(1);
+    for(codeId=-1; codeId < HAMMINGCODES; codeId++)
+    {
+        if (codeId < 0)
+        {
+            bitReaderInit(&br);
+            bitReaderFeed(&br, msg, BENCHMSGLEN);
+            flen = hammingStreamEncode(&br, frame, sizeof(frame));
+            flen += hammingStreamFlush(&br, frame+flen);
+        }
+        else
+        {
+            flen = hammingCodeEncoder(codeId, msg, BENCHMSGLEN, frame);
+        }
+
+        // Flip bits at the channel error rate, skipping the header
+        for(i=(codeId < 0 ? 0 : CODEDHEADERLEN); i < flen; i++)
+        {
+            for(j=0; j < 8; j++)
+            {
+                if (randPpm() < BENCHBERPPM) frame[i] ^= 1 << j;
+            }
+        }
+
+        tStart = ReadCoreTimer();
+        for(i=0; i < BENCHREPS; i++)
+        {
+            memcpy(rx, frame, flen);
+            if (codeId < 0)
+            {
+                hammingDecoder(rx, flen, DECODETABLE, &corrected,
+                        &uncorrectable);
+                dlen = hammingMessageDecoder(rx, flen, decoded);
+            }
+            else
+            {
+                dlen = hammingCodeDecoder(rx, flen, decoded, &corrected,
+                        &uncorrectable);
+            }
+        }
+        ticks = ReadCoreTimer() - tStart;
+
+        // Count the message bits still wrong after decoding
+        errors = 0;
+        for(i=0; i < BENCHMSGLEN; i++)
+        {
+            diff = i < dlen ? (decoded[i] ^ msg[i]) & 0x7F : 0x7F;
+            for(; diff; diff &= diff-1) errors++;
+        }
+
+        kBps = (unsigned int)((unsigned long long)BENCHMSGLEN*BENCHREPS
+                *(SYS_FREQ/2) / (ticks ? ticks : 1) / 1000);
+        if (codeId < 0)
+        {
+            len += sprintf(report+len, "(6,3) %u", 100*PACKETLEN/CODEWORDLEN);
+        }
+        else
+        {
+            len += sprintf(report+len, "%s(%d,%d) %u",
+                    hammingCodes[codeId].generator ? "BCH" :
+                    hammingCodes[codeId].secded ? "SECDED" : "",
+                    hammingCodes[codeId].n + hammingCodes[codeId].secded,
+                    hammingCodes[codeId].k,
+                    100*hammingCodes[codeId].k /
+                    (hammingCodes[codeId].n + hammingCodes[codeId].secded));
+        }
+        len += sprintf(report+len, " %u.%03u %u\r\n", kBps/1000, kBps%1000,
+                1000000/7*errors/BENCHMSGLEN);
+    }
+    return len;
+}
+
+// Transposes an 8x8 bit matrix held one row per byte. Bit b of in[r] ends
+// up in bit 7-r of out[7-b]. Applying it twice gives back the original.
+// From Hacker's Delight, section 7-3.
+void transpose8(const unsigned char *in, unsigned char *out)
+{
+    unsigned int x, y, t;
+
+    x = ((unsigned int)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+    y = ((unsigned int)in[4] << 24) | (in[5] << 16) | (in[6] << 8) | in[7];
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA;  x = x ^ t ^ (t << 7);
+    t = (y ^ (y >> 7)) & 0x00AA00AA;  y = y ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC; x = x ^ t ^ (t << 14);
+    t = (y ^ (y >> 14)) & 0x0000CCCC; y = y ^ t ^ (t << 14);
+    t = (x & 0xF0F0F0F0) | ((y >> 4) & 0x0F0F0F0F);
+    y = ((x << 4) & 0xF0F0F0F0) | (y & 0x0F0F0F0F);
+    x = t;
+
+    out[0] = x >> 24; out[1] = x >> 16; out[2] = x >> 8; out[3] = x;
+    out[4] = y >> 24; out[5] = y >> 16; out[6] = y >> 8; out[7] = y;
+}
+
+// Number of set bits in a word
+unsigned int popCount(unsigned int x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
+
+// Bit sliced version of the hammingEncodeTable lookup. Encodes n
+// PACKETLEN bit messages, one per char, into codewords. Same output as the
+// table for every message.
+void hammingBatchEncoder(const char *messages, char *codewords, int n)
+{
+    unsigned int m[3][BATCHWORDS];
+    unsigned char rows[8], cols[8];
+    int i, g, w, shift;
+    unsigned int m0, m1, m2;
+
+    for(i=0; i+BATCHLEN <= n; i+=BATCHLEN)
+    {
+        // Gather message bit b of every message into plane m[b]
+        memset(m, 0, sizeof(m));
+        for(g=0; g < BATCHLEN/8; g++)
+        {
+            transpose8((const unsigned char *)messages+i+8*g, cols);
+            w = g/4;
+            shift = 8*(g%4);
+            m[0][w] |= (unsigned int)cols[7] << shift;
+            m[1][w] |= (unsigned int)cols[6] << shift;
+            m[2][w] |= (unsigned int)cols[5] << shift;
+        }
+
+        // Codeword bits 5..3 are the message, 2..0 the parity from G
+        for(g=0; g < BATCHLEN/8; g++)
+        {
+            w = g/4;
+            shift = 8*(g%4);
+            m0 = m[0][w] >> shift;
+            m1 = m[1][w] >> shift;
+            m2 = m[2][w] >> shift;
+            cols[0] = 0;
+            cols[1] = 0;
+            cols[2] = m2;
+            cols[3] = m1;
+            cols[4] = m0;
+            cols[5] = m2 ^ m1 ^ m0;
+            cols[6] = m2 ^ m1;
+            cols[7] = m1 ^ m0;
+            transpose8(cols, rows);
+            memcpy(codewords+i+8*g, rows, 8);
+        }
+    }
+
+    // Finish the partial batch with the table
+    for(; i < n; i++)
+    {
+        codewords[i] = hammingEncodeTable[messages[i] & ((1 << PACKETLEN)-1)];
+    }
+}
+
+// Bit sliced version of hammingTableDetectorCorrector over a buffer of n
+// codewords. Corrects in place and counts corrected and uncorrectable
+// codewords, giving exactly the same results as the table decoder.
+void hammingBatchDecoder(char *codewords, int n, int *corrected,
+        int *uncorrectable)
+{
+    unsigned int c[8][BATCHWORDS];
+    unsigned char cols[8];
+    unsigned int s0, s1, s2, e0, e1, e2, e3, e4, e5, bad;
+    int i, g, w, b, shift;
+
+    for(i=0; i+BATCHLEN <= n; i+=BATCHLEN)
+    {
+        // Gather codeword bit b of every codeword into plane c[b]
+        memset(c, 0, sizeof(c));
+        for(g=0; g < BATCHLEN/8; g++)
+        {
+            transpose8((unsigned char *)codewords+i+8*g, cols);
+            w = g/4;
+            shift = 8*(g%4);
+            for(b=0; b < 8; b++)
+            {
+                c[b][w] |= (unsigned int)cols[7-b] << shift;
+            }
+        }
+
+        for(w=0; w < BATCHWORDS; w++)
+        {
+            // Syndrome bits from the columns of H
+            s2 = c[5][w] ^ c[4][w] ^ c[3][w] ^ c[2][w];
+            s1 = c[5][w] ^ c[4][w] ^ c[1][w];
+            s0 = c[4][w] ^ c[3][w] ^ c[0][w];
+
+            // Each correctable syndrome flips one bit, 011 is the one
+            // syndrome that matches no row of H
+            e5 = s2 & s1 & ~s0;
+            e4 = s2 & s1 & s0;
+            e3 = s2 & ~s1 & s0;
+            e2 = s2 & ~s1 & ~s0;
+            e1 = ~s2 & s1 & ~s0;
+            e0 = ~s2 & ~s1 & s0;
+            bad = ~s2 & s1 & s0;
+
+            c[5][w] ^= e5;
+            c[4][w] ^= e4;
+            c[3][w] ^= e3;
+            c[2][w] ^= e2;
+            c[1][w] ^= e1;
+            c[0][w] ^= e0;
+            for(b=0; b < 8; b++)
+            {
+                c[b][w] &= ~bad;
+            }
+
+            *corrected += popCount(e5 | e4 | e3 | e2 | e1 | e0);
+            *uncorrectable += popCount(bad);
+        }
+
+        // Scatter the planes back out to one codeword per char
+        for(g=0; g < BATCHLEN/8; g++)
+        {
+            w = g/4;
+            shift = 8*(g%4);
+            for(b=0; b < 8; b++)
+            {
+                cols[7-b] = c[b][w] >> shift;
+            }
+            transpose8(cols, (unsigned char *)codewords+i+8*g);
+        }
+    }
+
+    // Finish the partial batch with the table
+    for(; i < n; i++)
+    {
+        codewords[i] = hammingTableDetectorCorrector(codewords[i], corrected,
+                uncorrectable);
+    }
+}
+
+// Pushes BATCHBENCHBYTES of messages through the table and the batch
+// encoder, then the codewords with a scattering of errors through the
+// table and the batch decoder. Appends the throughput of each to report in
+// MB/s, along with whether the two agreed. Returns the number of chars
+// appended.
+int hammingBatchBenchmark(char *report)
+{
+    static char src[BATCHBENCHLEN];
+    static char tableBfr[BATCHBENCHLEN];
+    static char batchBfr[BATCHBENCHLEN];
+    unsigned int tStart, tableTicks, batchTicks, tableKBps, batchKBps;
+    int tableCorrected, tableUncorrectable;
+    int batchCorrected, batchUncorrectable;
+    int i, j, match, len;
+
+    srand(1);
+    for(i=0; i < BATCHBENCHLEN; i++)
+    {
+        src[i] = rand() & ((1 << PACKETLEN)-1);
+    }
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BATCHBENCHBYTES/BATCHBENCHLEN; i++)
+    {
+        for(j=0; j < BATCHBENCHLEN; j++)
+        {
+            tableBfr[j] = hammingEncodeTable[(int)src[j]];
+        }
+    }
+    tableTicks = ReadCoreTimer() - tStart;
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BATCHBENCHBYTES/BATCHBENCHLEN; i++)
+    {
+        hammingBatchEncoder(src, batchBfr, BATCHBENCHLEN);
+    }
+    batchTicks = ReadCoreTimer() - tStart;
+
+    match = memcmp(tableBfr, batchBfr, BATCHBENCHLEN) == 0;
+
+    tableKBps = (unsigned int)((unsigned long long)BATCHBENCHBYTES
+            *(SYS_FREQ/2) / (tableTicks ? tableTicks : 1) / 1000);
+    batchKBps = (unsigned int)((unsigned long long)BATCHBENCHBYTES
+            *(SYS_FREQ/2) / (batchTicks ? batchTicks : 1) / 1000);
+
+    len = sprintf(report, "encode MB/s table=%u.%03u batch=%u.%03u %s\r\n",
+            tableKBps/1000, tableKBps%1000, batchKBps/1000, batchKBps%1000,
+            match ? "match" : "MISMATCH");
+
+    // The batch encoded codewords with roughly one in sixteen hit by a
+    // random error
+    for(i=0; i < BATCHBENCHLEN; i++)
+    {
+        src[i] = batchBfr[i];
+        if ((rand() & 0x0F) == 0) src[i] ^= rand() & ((1 << CODEWORDLEN)-1);
+    }
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BATCHBENCHBYTES/BATCHBENCHLEN; i++)
+    {
+        memcpy(tableBfr, src, BATCHBENCHLEN);
+        hammingDecoder(tableBfr, BATCHBENCHLEN, DECODETABLE, &tableCorrected,
+                &tableUncorrectable);
+    }
+    tableTicks = ReadCoreTimer() - tStart;
+
+    tStart = ReadCoreTimer();
+    for(i=0; i < BATCHBENCHBYTES/BATCHBENCHLEN; i++)
+    {
+        memcpy(batchBfr, src, BATCHBENCHLEN);
+        hammingDecoder(batchBfr, BATCHBENCHLEN, DECODEBATCH, &batchCorrected,
+                &batchUncorrectable);
+    }
+    batchTicks = ReadCoreTimer() - tStart;
+
+    match = memcmp(tableBfr, batchBfr, BATCHBENCHLEN) == 0 &&
+            tableCorrected == batchCorrected &&
+            tableUncorrectable == batchUncorrectable;
+
+    tableKBps = (unsigned int)((unsigned long long)BATCHBENCHBYTES
+            *(SYS_FREQ/2) / (tableTicks ? tableTicks : 1) / 1000);
+    batchKBps = (unsigned int)((unsigned long long)BATCHBENCHBYTES
+            *(SYS_FREQ/2) / (batchTicks ? batchTicks : 1) / 1000);
+
+    len += sprintf(report+len,
+            "decode MB/s table=%u.%03u batch=%u.%03u %s\r\n",
+            tableKBps/1000, tableKBps%1000, batchKBps/1000, batchKBps%1000,
+            match ? "match" : "MISMATCH");
+    return len;
+}
+
+// Fills in the GF(2^5) log and antilog tables and the BCH syndrome
+// tables
+void initBchTables(void)
+{
+    unsigned int x = 1;
+    int i, j, lane, b;
+    unsigned char syndrome;
+
+    for(i=0; i < GFN; i++)
+    {
+        gfExp[i] = x;
+        gfExp[i+GFN] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & (1 << GFM)) x ^= GFPOLY;
+    }
+    gfLog[0] = 0;
+
+    for(i=0; i < (1 << CONVK); i++)
+    {
+        convOutput[i] = (byteParity[i & CONVG1] << 1) | byteParity[i & CONVG2];
+    }
+
+    // Syndrome S(2j+1) of byte b in lane i is the sum of alpha^(p(2j+1))
+    // over the codeword positions p it sets
+    for(j=0; j < BCHMAXT; j++)
+    {
+        for(lane=0; lane < 4; lane++)
+        {
+            for(i=0; i < 256; i++)
+            {
+                syndrome = 0;
+                for(b=0; b < 8; b++)
+                {
+                    if (i & (1 << b))
+                    {
+                        syndrome ^= gfExp[((8*lane+b)*(2*j+1)) % GFN];
+                    }
+                }
+                bchSyndromeTable[j][lane][i] = syndrome;
+            }
+        }
+    }
+}
+
+// Multiplies two GF(2^5) elements through the log tables
+unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0) return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+// Systematic BCH encode. The parity is the remainder of the shifted data
+// divided by the generator polynomial.
+unsigned int bchEncode(const HammingCode *code, unsigned int data)
+{
+    int parityLen = code->n - code->k;
+    unsigned int remainder;
+    int i;
+
+    data &= (1u << code->k)-1;
+    remainder = data << parityLen;
+    for(i=code->n-1; i >= parityLen; i--)
+    {
+        if (remainder & (1u << i))
+        {
+            remainder ^= code->generator << (i - parityLen);
+        }
+    }
+    return (data << parityLen) | remainder;
+}
+
+// Corrects up to t errors in a BCH codeword and returns its data bits.
+// The error locator comes from Berlekamp-Massey over the syndromes and
+// its roots from a Chien search. If the locator has more roots than the
+// search finds there were more than t errors, which is counted as
+// uncorrectable and decodes to zero.
+unsigned int bchCorrect(const HammingCode *code, unsigned int codeword,
+        int *corrected, int *uncorrectable)
+{
+    unsigned char S[2*BCHMAXT+1];
+    unsigned char C[2*BCHMAXT+2], B[2*BCHMAXT+2], T[2*BCHMAXT+2];
+    unsigned char d, b, scale, sum;
+    int L, m, i, j, r, roots;
+    int syndromeSet = 0;
+
+    codeword &= (1u << code->n)-1;
+
+    // Odd syndromes from the lane tables, even ones by squaring
+    for(j=0; j < code->t; j++)
+    {
+        S[2*j+1] = bchSyndromeTable[j][0][codeword & 0xFF] ^
+                   bchSyndromeTable[j][1][(codeword >> 8) & 0xFF] ^
+                   bchSyndromeTable[j][2][(codeword >> 16) & 0xFF] ^
+                   bchSyndromeTable[j][3][codeword >> 24];
+        syndromeSet |= S[2*j+1];
+    }
+    if (syndromeSet == 0) return codeword >> (code->n - code->k);
+    for(j=1; j <= code->t; j++)
+    {
+        S[2*j] = gfMul(S[j], S[j]);
+    }
+
+    // Berlekamp-Massey
+    memset(C, 0, sizeof(C));
+    memset(B, 0, sizeof(B));
+    C[0] = 1;
+    B[0] = 1;
+    L = 0;
+    m = 1;
+    b = 1;
+    for(r=0; r < 2*code->t; r++)
+    {
+        // Discrepancy of the current locator against the next syndrome
+        d = S[r+1];
+        for(i=1; i <= L; i++)
+        {
+            d ^= gfMul(C[i], S[r+1-i]);
+        }
+
+        if (d == 0)
+        {
+            m++;
+            continue;
+        }
+
+        // C(x) -= d/b x^m B(x)
+        scale = gfExp[gfLog[d] + GFN - gfLog[b]];
+        memcpy(T, C, sizeof(C));
+        for(i=0; i+m <= 2*code->t+1; i++)
+        {
+            C[i+m] ^= gfMul(scale, B[i]);
+        }
+        if (2*L <= r)
+        {
+            L = r+1-L;
+            memcpy(B, T, sizeof(B));
+            b = d;
+            m = 1;
+        }
+        else
+        {
+            m++;
+        }
+    }
+
+    if (L > code->t)
+    {
+        (*uncorrectable)++;
+        return 0;
+    }
+
+    // Chien search: an error at position i makes alpha^-i a root
+    roots = 0;
+    for(i=0; i < code->n; i++)
+    {
+        sum = C[0];
+        for(j=1; j <= L; j++)
+        {
+            if (C[j]) sum ^= gfExp[(gfLog[C[j]] + j*(GFN-i)) % GFN];
+        }
+        if (sum == 0)
+        {
+            codeword ^= 1u << i;
+            roots++;
+        }
+    }
+
+    if (roots != L)
+    {
+        (*uncorrectable)++;
+        return 0;
+    }
+    (*corrected)++;
+    return codeword >> (code->n - code->k);
+}
+
+// Times bchCorrect on BCHBENCHREPS blocks of each BCH code at every error
+// weight from 0 to one past the code's t and appends the cycles per block
+// to report. Past t a block is either flagged uncorrectable or silently
+// decoded to the wrong data, so those weights also report how many blocks
+// were miscorrected. Returns the number of chars appended.
+int bchBenchmark(char *report)
+{
+    static unsigned int blocks[BCHBENCHREPS];
+    static unsigned int data[BCHBENCHREPS];
+    const HammingCode *code;
+    unsigned int tStart, ticks, bit, mask, decoded;
+    int corrected, uncorrectable, flagged, miscorrected;
+    int codeId, weight, i, e, len = 0;
+
+    srand(1);
+    for(codeId=BCH3121; codeId <= BCH3116; codeId++)
+    {
+        code = &hammingCodes[codeId];
+        len += sprintf(report+len, "BCH(%d,%d) cycles/block", code->n,
+                code->k);
+
+        for(weight=0; weight <= code->t+1; weight++)
+        {
+            // Random data with weight distinct bits flipped
+            for(i=0; i < BCHBENCHREPS; i++)
+            {
+                data[i] = rand() & ((1u << code->k)-1);
+                blocks[i] = bchEncode(code, data[i]);
+                mask = 0;
+                for(e=0; e < weight; e++)
+                {
+                    do
+                    {
+                        bit = 1u << (rand() % code->n);
+                    } while (bit & mask);
+                    mask |= bit;
+                }
+                blocks[i] ^= mask;
+            }
+
+            corrected = 0;
+            uncorrectable = 0;
+            tStart = ReadCoreTimer();
+            for(i=0; i < BCHBENCHREPS; i++)
+            {
+                bchCorrect(code, blocks[i], &corrected, &uncorrectable);
+            }
+            ticks = ReadCoreTimer() - tStart;
+
+            len += sprintf(report+len, " w%d=%u", weight,
+                    2*ticks/BCHBENCHREPS);
+            if (weight <= code->t) continue;
+
+            // Untimed pass to count blocks decoded to the wrong data
+            miscorrected = 0;
+            for(i=0; i < BCHBENCHREPS; i++)
+            {
+                flagged = uncorrectable;
+                decoded = bchCorrect(code, blocks[i], &corrected,
+                        &uncorrectable);
+                if (uncorrectable == flagged && decoded != data[i])
+                {
+                    miscorrected++;
+                }
+            }
+            len += sprintf(report+len, " miscorrected=%d/%d", miscorrected,
+                    BCHBENCHREPS);
+        }
+        len += sprintf(report+len, "\r\n");
+    }
+    return len;
+}
+
+// Starts the convolutional encoder in the all zero state
+void convEncoderInit(ConvEncoder *ce)
+{
+    ce->reg = 0;
+    ce->bits = 0;
+    ce->bitCount = 0;
+}
+
+// Encodes the low seven bits of every char of msg, MSB first, and writes
+// the whole bytes of coded output. Coded bits that do not fill a byte are
+// kept for the next call. Returns the number of bytes written.
+int convEncode(ConvEncoder *ce, const char *msg, int len, char *out)
+{
+    int i, b, olen = 0;
+    unsigned int reg;
+
+    for(i=0; i < len; i++)
+    {
+        for(b=6; b >= 0; b--)
+        {
+            reg = (ce->reg << 1) | ((msg[i] >> b) & 1);
+            ce->bits = (ce->bits << 2) | convOutput[reg];
+            ce->bitCount += 2;
+            ce->reg = reg & (CONVSTATES-1);
+        }
+        while (ce->bitCount >= 8)
+        {
+            ce->bitCount -= 8;
+            out[olen++] = ce->bits >> ce->bitCount;
+        }
+    }
+    return olen;
+}
+
+// Runs K-1 zero tail bits through the encoder to bring it back to state
+// zero and pads out the last byte. Returns the number of bytes written.
+int convEncodeFlush(ConvEncoder *ce, char *out)
+{
+    int b, olen = 0;
+
+    for(b=0; b < CONVK-1; b++)
+    {
+        ce->bits = (ce->bits << 2) | convOutput[ce->reg << 1];
+        ce->bitCount += 2;
+        ce->reg = (ce->reg << 1) & (CONVSTATES-1);
+    }
+    while (ce->bitCount >= 8)
+    {
+        ce->bitCount -= 8;
+        out[olen++] = ce->bits >> ce->bitCount;
+    }
+    if (ce->bitCount > 0)
+    {
+        out[olen++] = ce->bits << (8 - ce->bitCount);
+        ce->bitCount = 0;
+    }
+    return olen;
+}
+
+// Starts the Viterbi decoder knowing the encoder began in state zero
+void viterbiInit(Viterbi *v)
+{
+    int s;
+
+    for(s=0; s < CONVSTATES; s++)
+    {
+        v->metric[s] = 1000;
+    }
+    v->metric[0] = 0;
+    v->head = 0;
+    v->pending = 0;
+    v->errors = 0;
+    v->bits = 0;
+    v->bitCount = 0;
+}
+
+// Follows the survivors back steps steps from state and writes the oldest
+// keep decoded bits into msg as 7 bit chars. Returns the number of chars
+// written.
+int viterbiTraceback(Viterbi *v, int state, int steps, int keep, char *msg)
+{
+    unsigned char path[TBLEN];
+    int i, slot, mlen = 0;
+
+    // The newest bit of every state is the input bit that led there
+    slot = v->head;
+    for(i=steps-1; i >= 0; i--)
+    {
+        slot = (slot + TBLEN - 1) % TBLEN;
+        path[i] = state & 1;
+        state = (state >> 1) |
+            (((v->decisions[slot][state/32] >> (state%32)) & 1) << (CONVK-2));
+    }
+
+    for(i=0; i < keep; i++)
+    {
+        v->bits = (v->bits << 1) | path[i];
+        if (++v->bitCount == 7)
+        {
+            msg[mlen++] = v->bits & 0x7F;
+            v->bits = 0;
+            v->bitCount = 0;
+        }
+    }
+    v->pending -= keep;
+    return mlen;
+}
+
+// Decodes len bytes of coded bits. Every coded symbol runs one add compare
+// select step over all states. Once the ring is full the oldest TBDEPTH
+// bits are committed from the best state. Returns the number of chars
+// written to msg.
+int viterbiDecode(Viterbi *v, const char *in, int len, char *msg)
+{
+    unsigned int next[CONVSTATES];
+    unsigned int m0, m1, best, dist0, dist1;
+    unsigned char symbol;
+    int i, b, s, bestState, mlen = 0;
+
+    for(i=0; i < len; i++)
+    {
+        for(b=6; b >= 0; b-=2)
+        {
+            symbol = (in[i] >> b) & 0x03;
+            v->decisions[v->head][0] = 0;
+            v->decisions[v->head][1] = 0;
+            best = 0xFFFFFFFF;
+            bestState = 0;
+
+            // State s is reached from s>>1 with a zero shifted out or from
+            // s>>1 | 32 with a one shifted out. Both carry input bit s&1.
+            for(s=0; s < CONVSTATES; s++)
+            {
+                dist0 = symbol ^ convOutput[s];
+                dist0 = (dist0 & 1) + (dist0 >> 1);
+                dist1 = symbol ^ convOutput[s | CONVSTATES];
+                dist1 = (dist1 & 1) + (dist1 >> 1);
+                m0 = v->metric[s >> 1] + dist0;
+                m1 = v->metric[(s >> 1) | (CONVSTATES/2)] + dist1;
+                if (m1 < m0)
+                {
+                    next[s] = m1;
+                    v->decisions[v->head][s/32] |= 1u << (s%32);
+                }
+                else
+                {
+                    next[s] = m0;
+                }
+                if (next[s] < best)
+                {
+                    best = next[s];
+                    bestState = s;
+                }
+            }
+
+            // Keep the metrics small, remembering what was taken off
+            for(s=0; s < CONVSTATES; s++)
+            {
+                v->metric[s] = next[s] - best;
+            }
+            v->errors += best;
+
+            v->head = (v->head + 1) % TBLEN;
+            if (++v->pending == TBLEN)
+            {
+                mlen += viterbiTraceback(v, bestState, TBLEN, TBDEPTH,
+                        msg+mlen);
+            }
+        }
+    }
+    return mlen;
+}
+
+// Ends the stream. The tail bits brought the encoder back to state zero so
+// the last traceback starts there, and the K-1 tail bits are dropped.
+// Returns the number of chars written to msg.
+int viterbiFlush(Viterbi *v, char *msg)
+{
+    int mlen = 0;
+
+    v->errors += v->metric[0];
+    if (v->pending >= CONVK-1)
+    {
+        mlen = viterbiTraceback(v, 0, v->pending, v->pending-(CONVK-1), msg);
+    }
+    v->pending = 0;
+    return mlen;
+}
+
+// Encodes a BENCHMSGLEN char message, flips coded bits at each of the
+// CONVBENCHRATES channel error rates, drawn from randPpm, and times the
+// Viterbi decoder.
+// Appends the decoded Mbit/s and the residual bit error rate at each
+// channel rate to report. Returns the number of chars appended.
+int convBenchmark(const char *myStr, char *report)
+{
+    static const unsigned int rates[CONVBENCHRATES] = {0, 1000, 10000,
+                                                       30000, 100000};
+    char msg[BENCHMSGLEN];
+    static char coded[2*BENCHMSGLEN+2];
+    char decoded[BENCHMSGLEN+1];
+    unsigned int tStart, ticks, kbps;
+    ConvEncoder ce;
+    Viterbi v;
+    int clen, dlen, errors;
+    int r, i, b, len = 0;
+    unsigned char diff;
+
+    for(i=0; i < BENCHMSGLEN; i++)
+    {
+        msg[i] = myStr[i % strlen(myStr)];
+    }
+
+    len += sprintf(report+len, "viterbi BER-ppm Mbit/s residual-ppm\r\n");
+    srand(1);
+    for(r=0; r < CONVBENCHRATES; r++)
+    {
+        convEncoderInit(&ce);
+        clen = convEncode(&ce, msg, BENCHMSGLEN, coded);
+        clen += convEncodeFlush(&ce, coded+clen);
+
+        for(i=0; i < clen; i++)
+        {
+            for(b=0; b < 8; b++)
+            {
+                if (randPpm() < rates[r]) coded[i] ^= 1 << b;
+            }
+        }
+
+        tStart = ReadCoreTimer();
+        viterbiInit(&v);
+        dlen = viterbiDecode(&v, coded, clen, decoded);
+        dlen += viterbiFlush(&v, decoded+dlen);
+        ticks = ReadCoreTimer() - tStart;
+
+        errors = 0;
+        for(i=0; i < BENCHMSGLEN; i++)
+        {
+            diff = i < dlen ? (decoded[i] ^ msg[i]) & 0x7F : 0x7F;
+            for(; diff; diff &= diff-1) errors++;
+        }
+
+        // Decoded bits per microsecond is Mbit/s, kept in thousandths
+        kbps = (unsigned int)((unsigned long long)7*BENCHMSGLEN
+                *(SYS_FREQ/2) / (ticks ? ticks : 1) / 1000);
+        len += sprintf(report+len, "%u %u.%03u %u\r\n", rates[r],
+                kbps/1000, kbps%1000, 1000000/7*errors/BENCHMSGLEN);
+    }
+    return len;
+}
+
+// Interleaves one frame of depth codewords of rowLen chars each. Every
+// group of 8 codewords has its chars at the same offset gathered and bit
+// transposed, so wire char (c*8 + k)*groups + g holds bit k of char c of
+// codewords 8g to 8g+7. The transpose works on two words in registers so
+// the frame is only read and written once.
+void interleave(const char *in, char *out, int rowLen, int depth)
+{
+    unsigned char col[8], bits[8];
+    int groups = depth/8;
+    int c, g, k;
+
+    for(c=0; c < rowLen; c++)
+    {
+        for(g=0; g < groups; g++)
+        {
+            for(k=0; k < 8; k++) col[k] = in[(8*g+k)*rowLen + c];
+            transpose8(col, bits);
+            for(k=0; k < 8; k++) out[(c*8+k)*groups + g] = bits[k];
+        }
+    }
+}
+
+// Undoes interleave. transpose8 is its own inverse so it is the same
+// gather and scatter the other way round.
+void deinterleave(const char *in, char *out, int rowLen, int depth)
+{
+    unsigned char col[8], bits[8];
+    int groups = depth/8;
+    int c, g, k;
+
+    for(c=0; c < rowLen; c++)
+    {
+        for(g=0; g < groups; g++)
+        {
+            for(k=0; k < 8; k++) bits[k] = in[(c*8+k)*groups + g];
+            transpose8(bits, col);
+            for(k=0; k < 8; k++) out[(8*g+k)*rowLen + c] = col[k];
+        }
+    }
+}
+
+// Builds an interleaved frame of n codewords, one per char. The last
+// frame of depth codewords is padded with the zero codeword. A depth that
+// is not a multiple of 8 is rounded down, and anything outside 8 to
+// MAXDEPTH becomes 8. Returns the frame length.
+int interleaveFrame(const char *codewords, int n, int depth, char *frame)
+{
+    char pad[MAXDEPTH];
+    int i, len = INTERLEAVEHEADERLEN;
+
+    depth &= ~7;
+    if (depth < 8 || depth > MAXDEPTH) depth = 8;
+
+    frame[0] = WIREINTERLEAVED;
+    frame[1] = depth;
+    frame[2] = n >> 8;
+    frame[3] = n;
+    for(i=0; i+depth <= n; i+=depth, len+=depth)
+    {
+        interleave(codewords+i, frame+len, 1, depth);
+    }
+    if (i < n)
+    {
+        memset(pad, 0, depth);
+        memcpy(pad, codewords+i, n-i);
+        interleave(pad, frame+len, 1, depth);
+        len += depth;
+    }
+    return len;
+}
+
+// Deinterleaves the whole frames of an interleaved frame and drops the
+// padding. Returns the number of codewords written, zero if the header
+// does not make sense.
+int deinterleaveFrame(const char *frame, int len, char *codewords)
+{
+    int depth = (unsigned char)frame[1];
+    int n = ((unsigned char)frame[2] << 8) | (unsigned char)frame[3];
+    int i;
+
+    if (len < INTERLEAVEHEADERLEN || (depth & 7) || depth < 8 ||
+            depth > MAXDEPTH) return 0;
+
+    len -= INTERLEAVEHEADERLEN;
+    len -= len % depth;
+    if (n > len) n = len;
+    for(i=0; i < len; i+=depth)
+    {
+        deinterleave(frame+INTERLEAVEHEADERLEN+i, codewords+i, 1, depth);
+    }
+    return n;
+}
+
+// Gilbert-Elliott burst channel over len chars, LSB of each char first
+void burstChannel(char *bfr, int len)
+{
+    int i, j, burst = 0;
+
+    for(i=0; i < len; i++)
+    {
+        for(j=0; j < 8; j++)
+        {
+            if (burst) burst = (rand() % BURSTLEN) != 0;
+            else burst = randPpm() < BURSTSTARTPPM;
+            if (burst && (rand() & 1)) bfr[i] ^= 1 << j;
+        }
+    }
+}
+
+// Sends the (6,3) codewords of a BENCHMSGLEN char message through the
+// burst channel without interleaving and at each depth, and appends the
+// residual message bit error rate and the cycles per codeword of
+// interleaving plus deinterleaving to report. Every depth sees the same
+// random sequence. Returns the number of chars appended.
+int interleaveBenchmark(const char *myStr, char *report)
+{
+    static const int depths[INTERLEAVEDEPTHS] = {0, 8, 16, 32};
+    char msg[BENCHMSGLEN];
+    static char codewords[BENCHMSGLEN*7/PACKETLEN];
+    static char frame[BENCHMSGLEN*7/PACKETLEN+MAXDEPTH+INTERLEAVEHEADERLEN];
+    static char rx[BENCHMSGLEN*7/PACKETLEN+MAXDEPTH];
+    char decoded[BENCHMSGLEN+1];
+    unsigned int tStart, ticks;
+    int corrected, uncorrectable;
+    int n, flen, clen, dlen, errors;
+    int d, i, len = 0;
+    unsigned char diff;
+    BitReader br;
+
+    for(i=0; i < BENCHMSGLEN; i++)
+    {
+        msg[i] = myStr[i % strlen(myStr)];
+    }
+    bitReaderInit(&br);
+    bitReaderFeed(&br, msg, BENCHMSGLEN);
+    n = hammingStreamEncode(&br, codewords, sizeof(codewords));
+    n += hammingStreamFlush(&br, codewords+n);
+
+    len += sprintf(report+len, "interleave depth residual-ppm "
+            "cycles/codeword\r\n");
+    for(d=0; d < INTERLEAVEDEPTHS; d++)
+    {
+        ticks = 0;
+        srand(1);
+        if (depths[d] == 0)
+        {
+            memcpy(rx, codewords, n);
+            burstChannel(rx, n);
+            clen = n;
+        }
+        else
+        {
+            tStart = ReadCoreTimer();
+            for(i=0; i < BENCHREPS; i++)
+            {
+                flen = interleaveFrame(codewords, n, depths[d], frame);
+                clen = deinterleaveFrame(frame, flen, rx);
+            }
+            ticks = ReadCoreTimer() - tStart;
+
+            burstChannel(frame+INTERLEAVEHEADERLEN, 
+                    flen-INTERLEAVEHEADERLEN);
+            clen = deinterleaveFrame(frame, flen, rx);
+        }
+        hammingDecoder(rx, clen, DECODETABLE, &corrected, &uncorrectable);
+        dlen = hammingMessageDecoder(rx, clen, decoded);
+
+        errors = 0;
+        for(i=0; i < BENCHMSGLEN; i++)
+        {
+            diff = i < dlen ? (decoded[i] ^ msg[i]) & 0x7F : 0x7F;
+            for(; diff; diff &= diff-1) errors++;
+        }
+        len += sprintf(report+len, "%d %u %u\r\n", depths[d],
+                1000000/7*errors/BENCHMSGLEN, 2*ticks/(BENCHREPS*n));
+    }
+    return len;
+}
@@ -22,6 +22,8 @@
 
 
 #include <string.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <time.h>
 #include <plib.h>		// PIC32 Peripheral library functions and macros
 #include "tcpip_bsd_config.h"	// in \source
@@ -39,36 +41,289 @@
 // Project specific constants
 #define MSGLEN 26
 #define DATALEN 16
-#define LENP 1
-#define LENM 10
+#define LENP 4  // Send window. At most half of the sequence space
+
+// Sequence numbers are SEQBITS wide, up to 32, and wrap to zero. They are
+// compared as in RFC 1982, by their distance mod 2^SEQBITS, so any window
+// within half the space works across the wrap.
+#define SEQBITS 8
+#define SEQMASK (0xFFFFFFFFu >> (32-SEQBITS))
+#if LENP > (1 << (SEQBITS-1))
+#error LENP must be at most half of the 2^SEQBITS sequence space
+#endif
+
+// 32 bit words of a bitmap with a bit per frame of the window
+#define LENPWORDS ((LENP+31)/32)
 #define PROBERR 0.1
-#define ACKTIMEOUT 5000 // InMSEC
+#define ACKTIMEOUT 5000 // InMSEC. Timeout until the first RTT sample
+#define RTOMINMSEC 10
+#define RTOMAXMSEC 60000u // In ticks this only fits an unsigned int
+
+// Core timer ticks per millisecond. The core timer runs at SYS_FREQ/2.
+#define TICKSPERMSEC (SYS_FREQ/2000)
+
+// Goodput simulation of the '0266' benchmark. Frame loss rates are in
+// percent and apply to the frame and its ACK together.
+#define SIMFRAMES 1000
+#define SIMRTTMS 20
+#define SIMLOSSRATES 3
+
+// Passes of the whole message through the reorder buffer benchmark
+#define SIMPASSES 40
+
+// Timer wheel. A wheel tick is WHEELTICK core timer ticks and each of the
+// WHEELLEVELS levels has WHEELSLOTS slots, a slot of level l spanning
+// WHEELSLOTS^l wheel ticks. Timers reach up to WHEELSLOTS^WHEELLEVELS wheel
+// ticks ahead, which covers RTOMAXMSEC.
+#define WHEELTICK TICKSPERMSEC
+#define WHEELBITS 6
+#define WHEELSLOTS (1 << WHEELBITS)
+#define WHEELMASK (WHEELSLOTS-1)
+#define WHEELLEVELS 3
+
+// Timer benchmark of the '0266' report. TIMERPROBES timers run out at
+// random within TIMERSPANMSEC.
+#define TIMERPROBES 1000
+#define TIMERSPANMSEC 1000
+
+// Time each step of an LED animation lasts
+#define LEDSTEPMSEC 50
+
+// 1 runs the connect animation to the end before the client is served,
+// like the old DelayMsec blink, so setup-us can be compared both ways
+#define LEDBLOCKING 0
+
+// Receive ring size, a power of two. Most frames a full ring can hold
+// and the longest frame, which is how far a frame can run past its end.
+#define RXRING 512
+#define RXFRAMES (RXRING/sizeof(struct myDataPacket))
+#define MAXFRAMELEN sizeof(struct myDataPacket)
+
+// Send buffer size. Holds the ACKs for a full receive ring and a full
+// window of frames, which go out together.
+#define TXLEN (RXFRAMES*sizeof(struct myACK) + \
+    LENP*sizeof(struct myDataPacket))
+
+// Frame types of the frame header
+#define FRAMEDATA 0x01
+#define FRAMEACK 0x06
 
 // We create structs for our message format
 // For explanation of pragma see:
 // http://stackoverflow.com/questions/1577161/passing-a-structure-through-sockets-in-c
+#if SEQBITS <= 8
+typedef uint8_t wireSeq;
+#elif SEQBITS <= 16
+typedef uint16_t wireSeq;
+#else
+typedef uint32_t wireSeq;
+#endif
+
 #pragma pack(1)
 
-// ACK Struct
+// Every frame starts with this header. length counts the bytes after the
+// header, so frames of any type can follow each other in one buffer.
+struct frameHeader
+{
+    uint8_t type;
+    uint8_t length;
+    wireSeq sequence;
+};
+
+// ACK Struct. Starts with the frameHeader fields.
 struct myACK
 {
-    uint8_t sequence;
+    uint8_t type;
+    uint8_t length;
+    wireSeq sequence;
     char ackChar;
 };
 
-// WARNING IF myDataPacket length and myACKs are multiples of one another,
-// the packet detection algo will fail. 
+// Data Struct. Starts with the frameHeader fields.
 struct myDataPacket 
 {
-    uint8_t sequence;
+    uint8_t type;
+    uint8_t length;
+    wireSeq sequence;
     char data[DATALEN];
 };
 #pragma pack(0) // turn packing off
 
-void DelayMsec(unsigned int msec);
+// Payload lengths the header of each frame type must carry
+#define ACKPAYLOAD (sizeof(struct myACK) - sizeof(struct frameHeader))
+#define DATAPAYLOAD (sizeof(struct myDataPacket) - sizeof(struct frameHeader))
+
+// Retransmission timeout estimator. srtt and rttvar are the smoothed
+// round trip time and its mean deviation in core timer ticks, rto is the
+// timeout they give.
+struct rttEstimator
+{
+    unsigned int srtt;
+    unsigned int rttvar;
+    unsigned int rto;
+    uint8_t sampled;
+};
+
+// Timer of the timer wheel. While it runs it is linked into a slot list
+// by next and pprev, which points at the link to it, and pprev is NULL
+// otherwise. expires is the wheel tick it runs out at, when handler is
+// called with it.
+struct wheelTimer
+{
+    struct wheelTimer *next;
+    struct wheelTimer **pprev;
+    unsigned int expires;
+    void (*handler)(struct wheelTimer *timer);
+    void *arg;
+};
+
+// Hierarchical timer wheel on the core timer. now is the next wheel tick
+// to run and due the core timer tick it is due at. A timer that runs out
+// within WHEELSLOTS wheel ticks sits in the level 0 slot of its tick, any
+// other in the lowest level that reaches it, and drops a level whenever
+// now gets to the start of its slot. pending counts the running timers.
+struct timerWheel
+{
+    struct wheelTimer *slot[WHEELLEVELS][WHEELSLOTS];
+    unsigned int now;
+    unsigned int due;
+    int pending;
+};
+
+// LED animation run by a wheel timer instead of waited out. Step i lights
+// the LEDs in pattern[i] for LEDSTEPMSEC. step is the step showing while
+// timer runs.
+struct ledAnimation
+{
+    struct wheelTimer timer;
+    struct timerWheel *wheel;
+    const unsigned int *pattern;
+    int steps;
+    int step;
+};
+
+// A new connection runs LED1 to LED3
+const unsigned int ledConnect[3] = {BIT_0, BIT_1, BIT_2};
+
+// A timer of the timer benchmark and the core timer tick it is due at
+struct probeTimer
+{
+    struct wheelTimer timer;
+    unsigned int deadline;
+};
+
+// Results of the timer benchmark. Lateness is in core timer ticks.
+struct probeStats
+{
+    int fired;
+    int early;
+    unsigned int lateMax;
+    long long lateSum;
+};
+
+// One frame of the send window and its own timer. sentAt is the core
+// timer tick of its first send and resent is set once it is sent again,
+// after which its ACK gives no RTT sample.
+struct txSlot
+{
+    struct myDataPacket packet;
+    struct wheelTimer timer;
+    unsigned int sentAt;
+    uint8_t resent;
+};
+
+// Selective repeat sender. Frames base to next-1 of the message are in
+// flight and frame m sits in slot m % LENP. Bit m % LENP of acked is set
+// once frame m is ACKed, so the window slides by the run of one bits
+// from base. The frame timers run on wheel and set the bit of their slot
+// in due when they run out.
+struct srSender
+{
+    struct txSlot slot[LENP];
+    int base;
+    int next;
+    uint32_t acked[LENPWORDS];
+    uint32_t due[LENPWORDS];
+    struct rttEstimator rtt;
+    struct timerWheel *wheel;
+};
+
+// Selective repeat receiver. expected is the sequence number of the next
+// frame to deliver and delivered the number of frames delivered so far.
+// The frame offset frames after expected waits in slot (delivered+offset)
+// % LENP, and the same bit of present is set while the slot holds it.
+struct srReceiver
+{
+    struct myDataPacket slot[LENP];
+    uint32_t present[LENPWORDS];
+    uint32_t expected;
+    int delivered;
+};
+
+// Receive ring. recvfrom writes straight into the free space at tail and
+// frames are parsed where they lie from head. Both count bytes since the
+// reset and are taken mod RXRING when used. The MAXFRAMELEN bytes after
+// the end repeat the start of bytes while a frame runs past the end, so
+// every frame can be viewed in one piece.
+struct rxRing
+{
+    char bytes[RXRING + MAXFRAMELEN];
+    unsigned int head;
+    unsigned int tail;
+};
+
 void generateAlphabet(struct myDataPacket *tbfrData, int tlen) ;
+int frameLength(const char *buf, int len);
+uint8_t frameType(const char *frame);
+uint32_t frameSequence(const char *frame);
+char frameAckChar(const char *frame);
+void ringReset(struct rxRing *ring);
+char *ringSpace(struct rxRing *ring, int *len);
+void ringCommit(struct rxRing *ring, int len);
+int ringCommand(struct rxRing *ring);
+char *ringFrame(struct rxRing *ring, int *len);
+void ringConsume(struct rxRing *ring, int len);
 double randMToN(double M, double N);
-void shuffle(uint8_t *array, size_t n);
+void shuffle(wireSeq *array, size_t n);
+void rtoReset(struct rttEstimator *est);
+void rtoSample(struct rttEstimator *est, unsigned int ticks);
+void rtoBackoff(struct rttEstimator *est);
+void wheelReset(struct timerWheel *wheel);
+void wheelInsert(struct timerWheel *wheel, struct wheelTimer *timer);
+int wheelService(struct timerWheel *wheel, unsigned int core);
+void timerInit(struct wheelTimer *timer, 
+        void (*handler)(struct wheelTimer *timer), void *arg);
+void timerStart(struct timerWheel *wheel, struct wheelTimer *timer, 
+        unsigned int ticks);
+void timerStop(struct timerWheel *wheel, struct wheelTimer *timer);
+int timerPending(struct wheelTimer *timer);
+uint32_t sequenceOf(int msgIndex);
+uint32_t seqOffset(uint32_t from, uint32_t to);
+int seqLess(uint32_t a, uint32_t b);
+int bitGet(const uint32_t *bits, int i);
+void bitSet(uint32_t *bits, int i);
+void bitClear(uint32_t *bits, int i);
+void senderInit(struct srSender *sender, struct timerWheel *wheel);
+void senderReset(struct srSender *sender);
+void frameTimedOut(struct wheelTimer *timer);
+int senderFill(struct srSender *sender, struct myDataPacket *tbfrData,
+        struct myDataPacket *tbfr);
+int senderAck(struct srSender *sender, uint32_t sequence);
+int findFirstZero(uint32_t bits);
+int senderExpired(struct srSender *sender, struct myDataPacket *tbfr);
+void receiverReset(struct srReceiver *receiver);
+int receiverAccept(struct srReceiver *receiver, const char *frame);
+int receiverDeliver(struct srReceiver *receiver, char *msg, int maxLen);
+int reorderBenchmark(char *report);
+int batchGoodput(int lossPct);
+int windowGoodput(int lossPct, int adaptive);
+int goodputBenchmark(char *report);
+void ledInit(struct ledAnimation *led, struct timerWheel *wheel);
+void ledStart(struct ledAnimation *led, const unsigned int *pattern, 
+        int steps);
+void ledStep(struct wheelTimer *timer);
+void probeExpired(struct wheelTimer *timer);
+int timerBenchmark(char *report);
 
 int main()
 {
@@ -80,34 +335,46 @@ int main()
     int i,j;
     int temp; 
 
-    // Delay interaction counter
-    int delayCount = 0;    
-    
     // Initialize buffer length variables
     int tlen, rlen;
+
+    // Frame parsing. frame is a view of the frame being parsed in
+    // rbfrRing and flen its length. command is the byte after an '02'.
+    char *frame;
+    int flen;
+    int command = 0;
+    int acksIn;
     
     // Initialize the buffers for server
-    struct myDataPacket *rbfrData;
-    struct myACK rbfrAck[LENP];
-    char rbfrRaw[256] = {0};
-    uint8_t rbfrDataTracker[LENP] = {NULL};
+    struct rxRing rbfrRing;
+    char *rbfrSpace;
+    int rbfrSpaceLen;
+    struct myACK rbfrAck[RXFRAMES];
+    wireSeq rbfrDataTracker[RXFRAMES] = {0};
     uint8_t rbfrDataTrackerI = 0;
+    struct srReceiver receiver;
+
+    // Message delivered in order by the receiver
+    char rbfrMsg[MSGLEN*DATALEN];
+    int msgReceived = 0;
 
     // Initialize the buffers for client
     struct myDataPacket tbfrData[MSGLEN];
-    struct myACK *tbfrAck;
     struct myDataPacket tbfr[LENP];
-    uint8_t tbfrDataTracker[LENP+LENM] = {NULL};
-    uint8_t tbfrDataTrackerI = 0;
-    uint8_t tbfrAckTracker[LENP+LENM] = {NULL};
-    int tbfrAckTrackerI = 0;
-    uint8_t tbfrSeqTracker = 0;
-    uint8_t selectiveRepeat = 0;
-    uint8_t flag;
+    char tbfrRaw[TXLEN];
+    struct srSender sender;
     uint8_t testStarted = 0;
-    int msgSent = 0;
-    int offset;
     int count = 0;
+    char report[384];
+
+    // Every timer runs on this wheel, which the loop services each pass
+    struct timerWheel wheel;
+
+    // LED animation, and how long in core timer ticks the last client
+    // waited from accept until its first message was read
+    struct ledAnimation led;
+    unsigned int acceptedAt, setupTicks = 0;
+    int setupPending = 0;
     
     // Socket struct descriptor
     struct sockaddr_in addr;
@@ -162,6 +429,9 @@ int main()
     // We create our transmission data using the alphabet. 26 packets total
     tlen = MSGLEN;
     generateAlphabet(tbfrData, tlen);
+    wheelReset(&wheel);
+    senderInit(&sender, &wheel);
+    ledInit(&led, &wheel);
     
     // Loop forever
     while (1) 
@@ -170,6 +440,9 @@ int main()
         TCPIPProcess();
         DHCPTask();
 
+        // Run the handlers of the timers that ran out
+        wheelService(&wheel, ReadCoreTimer());
+
         // set the machines IP address and save to variable
         ip.Val = TCPIPGetIPAddr();
 
@@ -186,208 +459,184 @@ int main()
             // Upon connection to a client blink LEDS.
             if (clientSock != INVALID_SOCKET) 
             {
+                acceptedAt = ReadCoreTimer();
+                setupPending = 1;
                 setsockopt(clientSock, SOL_SOCKET, TCP_NODELAY, 
                     (char*)&tlen, sizeof(int));
-                mPORTDSetBits(BIT_0); // LED1=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_0); // LED1=0
-                mPORTDSetBits(BIT_1); // LED2=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_1); // LED2=0
-                mPORTDSetBits(BIT_2); // LED3=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_2); // LED3=0
+                // Every new link starts from the initial timeout and an
+                // empty receive ring
+                rtoReset(&sender.rtt);
+                ringReset(&rbfrRing);
+                ledStart(&led, ledConnect, 3);
+#if LEDBLOCKING
+                while (timerPending(&led.timer))
+                {
+                    wheelService(&wheel, ReadCoreTimer());
+                }
+#endif
             }
         } 
         else 
         {
             // We are connected to a client already. We start
-            // by receiving the message being sent by the client
-            rlen = recvfrom(clientSock, rbfrRaw, sizeof (rbfrRaw), 0, NULL,
+            // by receiving the message being sent by the client. It goes
+            // straight into the receive ring, after any frame cut off by
+            // the last receive.
+            rbfrSpace = ringSpace(&rbfrRing, &rbfrSpaceLen);
+            rlen = recvfrom(clientSock, rbfrSpace, rbfrSpaceLen, 0, NULL,
                     NULL);
 
             // Check to see if socket is still alive
             if (rlen > 0) 
             {
-                // Reset Delay Count
-                delayCount = 0;
+                // The first message read ends the connection setup
+                if (setupPending)
+                {
+                    setupTicks = ReadCoreTimer() - acceptedAt;
+                    setupPending = 0;
+                }
+
+                ringCommit(&rbfrRing, rlen);
+
+                // Between tests only commands are expected. Whatever 
+                // follows a command, or is none, is dropped.
+                if (testStarted == 0)
+                {
+                    command = ringCommand(&rbfrRing);
+                    if (command != 0) ringReset(&rbfrRing);
+                }
+
                 // Check to see if message begins with
                 // '0271' signifying message is a global reset
                 // We use this as a signal to start the lab
                 // experiment. 
-                if ((testStarted == 0) && (rbfrRaw[0] == 02) && 
-                        (rbfrRaw[1] == 71))
+                if ((testStarted == 0) && (command == 71))
                 {                        
-                    // Reset Frame Sent Variables
-                    tbfrDataTrackerI = 0;
-                    tbfrAckTrackerI = 0;
-
-                    // Reset Sequence Number
-                    tbfrSeqTracker = 1;
-
-                    // Reset total msg sent counter
-                    msgSent = 0;
+                    // Reset the send window and retransmit count
+                    senderReset(&sender);
+                    receiverReset(&receiver);
+                    msgReceived = 0;
                     count = 0;
                     testStarted = 1;
 
-                    for(tbfrDataTrackerI=0; tbfrDataTrackerI < LENP; 
-                        tbfrDataTrackerI++)
-                    {
-                        // Check for seq rollover
-                        if(tbfrSeqTracker >= LENM)
-                        {
-                            tbfrSeqTracker = 1;
-                        }
-
-                        // Adjust offset
-                        if(tbfrDataTrackerI==0) offset=msgSent;
-                        // Populate sequence number
-                        tbfrData[tbfrDataTrackerI+offset].sequence = 
-                            tbfrSeqTracker++;
-
-                        // We keep track of the seq numbers we do send
-                        tbfrDataTracker[tbfrDataTrackerI] = 
-                            tbfrData[tbfrDataTrackerI+offset].sequence;
-
-                        // Copy tbfr over to 
-                        tbfr[tbfrDataTrackerI] = 
-                            tbfrData[tbfrDataTrackerI+offset];
-
-                        // Keep track of how much of the msg has been
-                        // sent
-                        msgSent++;
-
-                        if (msgSent > MSGLEN)
-                        {
-                            break;
-                        } 
-                    }
+                    // Fill the window with the first LENP frames
+                    tlen = senderFill(&sender, tbfrData, tbfr);
                     mPORTDClearBits(BIT_0);
                     mPORTDSetBits(BIT_2);   // LED3=1
                     send(clientSock, tbfr, 
-                        sizeof(struct myDataPacket)*tbfrDataTrackerI, 0);
+                        sizeof(struct myDataPacket)*tlen, 0);
+                    mPORTDClearBits(BIT_2); // LED3=0
+                }
+                // Check to see if message begins with
+                // '0266' signifying a goodput benchmark request. The
+                // results are sent back as text.
+                else if ((testStarted == 0) && (command == 66))
+                {
+                    mPORTDSetBits(BIT_2);   // LED3=1
+                    tlen = goodputBenchmark(report);
+                    tlen += reorderBenchmark(report+tlen);
+                    tlen += timerBenchmark(report+tlen);
+                    tlen += sprintf(report+tlen, "setup-us\r\n%u\r\n",
+                            setupTicks/(TICKSPERMSEC/1000));
+                    send(clientSock, report, tlen, 0);
                     mPORTDClearBits(BIT_2); // LED3=0
-                    DelayMsec(100);
                 }
-                // If not prefixed we say client is sending back 
-                // we need to parse to determine if message is an ACK or
-                // the received data
+                // If not prefixed we say client is sending back frames.
+                // Data and ACKs may be mixed in one buffer, each frame
+                // header says which it is.
                 else if (testStarted==1)
                 {
-                    // Check what time of message was revived based on its
-                    // size
-                    // Check if received is an myDataPacket
-                    if (rlen%sizeof(struct myDataPacket)==0)
+                    acksIn = 0;
+
+                    // Reset data packets received
+                    rbfrDataTrackerI = 0;
+
+                    // Parse every whole frame in the ring where it lies. A
+                    // frame cut off at the end stays for the next receive.
+                    while ((frame = ringFrame(&rbfrRing, &flen)) != NULL)
                     {
-                        i=0;
-                        // Reset data packets received
-                        rbfrDataTrackerI = 0;
-                        
-                        // Parse the receive buffer until end of buffer
-                        while (sizeof(struct myDataPacket)*i < rlen)
+                        ringConsume(&rbfrRing, flen);
+
+                        if (frameType(frame) == FRAMEDATA)
                         {
-                            // Convert the received data into a dataPacket 
-                            // struct
-                            rbfrData = (struct myDataPacket *) rbfrRaw+(i++);
-                            // Retrieve sequence number and store
-                            rbfrDataTracker[rbfrDataTrackerI++] = 
-                                rbfrData->sequence;
+                            // Buffer the frame and keep its sequence number
+                            // to ACK. Duplicates are ACKed again since
+                            // their first ACK may have been lost.
+                            if (receiverAccept(&receiver, frame) >= 0)
+                            {
+                                rbfrDataTracker[rbfrDataTrackerI++] = 
+                                    frameSequence(frame);
+                            }
                         }
-                        // Shuffle order of rbfrDataTracker ACKs we will send 
-                        // back
-                        shuffle(rbfrDataTracker, rbfrDataTrackerI);
-                        
-                        j=0;
-                        // Set sequence number P to zero and send LENP packets
-                        for(i=0; i < rbfrDataTrackerI; i++)
+                        else
                         {
-                            // Send ACK for Random number of packets
-                            if (randMToN(0.0,1.0) >= PROBERR)
+                            // Mark the frame with that sequence number
+                            if (frameAckChar(frame) == 0x06)
                             {
-                                rbfrAck[j].sequence = rbfrDataTracker[i];
-                                rbfrAck[j].ackChar = 0x06;
-                                j++;
+                                senderAck(&sender, frameSequence(frame));
                             }
+                            acksIn++;
                         }
-                        mPORTDClearBits(BIT_0);
-                        mPORTDSetBits(BIT_2);   // LED3=1
-                        send(clientSock, rbfrAck, 
-                            sizeof(struct myACK)*j, 0);
-                        mPORTDClearBits(BIT_2); // LED3=0
-                        DelayMsec(100);
                     }
-                    // Check if received is an myACK
-                    else if (rlen%sizeof(struct myACK)==0)
+
+                    // A bad header means the framing is lost, so nothing
+                    // held can be trusted
+                    if (flen < 0) ringReset(&rbfrRing);
+
+                    // Hand every in order run to the message in one go.
+                    // LED2 shows a complete message.
+                    msgReceived += receiverDeliver(&receiver, 
+                        rbfrMsg+msgReceived, sizeof(rbfrMsg)-msgReceived);
+                    if (msgReceived == sizeof(rbfrMsg))
                     {
-                        // Randomize the 
-                        // Parse the receive buffer for myACK until end of
-                        // buffer
-                        i=0;
-                        while (sizeof(struct myACK)*i < rlen)
-                        {
-                            // Convert the received data into a myAck struct
-                            tbfrAck = (struct myACK *) rbfrRaw+(i++);
-                            
-                            // Retrieve sequence number and store
-                            tbfrAckTracker[tbfrAckTrackerI++] = 
-                                tbfrAck->sequence;
-                        }
-                        // Check if we recieved all the frames we orignally
-                        // sent. If yes transfer the next M frames
-                        if (tbfrAckTrackerI >= tbfrDataTrackerI)
+                        mPORTDSetBits(BIT_1);   // LED2=1
+                        msgReceived = 0;
+                    }
+
+                    // Shuffle order of rbfrDataTracker ACKs we will send 
+                    // back
+                    shuffle(rbfrDataTracker, rbfrDataTrackerI);
+                    
+                    j=0;
+                    // Set sequence number P to zero and send LENP packets
+                    for(i=0; i < rbfrDataTrackerI; i++)
+                    {
+                        // Send ACK for Random number of packets
+                        if (randMToN(0.0,1.0) >= PROBERR)
                         {
-                            if (msgSent > MSGLEN)
-                            {
-                                testStarted=0;
-                            }
-                            else 
-                            {
-                                // Check if there are more frames to send
-                                // Reset Frame Sent Variables
-                                tbfrAckTrackerI = 0;
-
-                                for(tbfrDataTrackerI=0; tbfrDataTrackerI < LENP; 
-                                    tbfrDataTrackerI++)
-                                {
-                                    // Check for seq rollover
-                                    if(tbfrSeqTracker >= LENM)
-                                    {
-                                        tbfrSeqTracker = 1;
-                                    }
-
-                                    // Adjust offset
-                                    if(tbfrDataTrackerI==0) offset=msgSent;
-                                    // Populate sequence number
-                                    tbfrData[tbfrDataTrackerI+offset].sequence = 
-                                        tbfrSeqTracker++;
-
-                                    // We keep track of the seq numbers we do send
-                                    tbfrDataTracker[tbfrDataTrackerI] = 
-                                        tbfrData[tbfrDataTrackerI+offset].sequence;
-
-                                    // Copy tbfr over to 
-                                    tbfr[tbfrDataTrackerI] = 
-                                        tbfrData[tbfrDataTrackerI+offset];
-
-                                    // Keep track of how much of the msg has been
-                                    // sent
-                                    msgSent++;
-
-                                    if (msgSent > MSGLEN)
-                                    {
-                                        break;
-                                    }
-                                }
-                                mPORTDClearBits(BIT_0);
-                                mPORTDSetBits(BIT_2);   // LED3=1
-                                send(clientSock, tbfr, 
-                                    sizeof(struct myDataPacket)*tbfrDataTrackerI, 0);
-                                mPORTDClearBits(BIT_2); // LED3=0
-
-                                DelayMsec(100);
-                            }
+                            rbfrAck[j].type = FRAMEACK;
+                            rbfrAck[j].length = ACKPAYLOAD;
+                            rbfrAck[j].sequence = rbfrDataTracker[i];
+                            rbfrAck[j].ackChar = 0x06;
+                            j++;
                         }
-                    }                    
+                    }
+
+                    // Check if every frame has been ACKed. If not send
+                    // the new frames the window slid over.
+                    tlen = 0;
+                    if (acksIn > 0 && sender.base >= MSGLEN)
+                    {
+                        testStarted=0;
+                        ringReset(&rbfrRing);
+                    }
+                    else if (acksIn > 0)
+                    {
+                        tlen = senderFill(&sender, tbfrData, tbfr);
+                    }
+
+                    // The ACKs and the new frames go out in one send
+                    if (j > 0 || tlen > 0)
+                    {
+                        memcpy(tbfrRaw, rbfrAck, sizeof(struct myACK)*j);
+                        memcpy(tbfrRaw+sizeof(struct myACK)*j, tbfr, 
+                            sizeof(struct myDataPacket)*tlen);
+                        mPORTDClearBits(BIT_0);
+                        mPORTDSetBits(BIT_2);   // LED3=1
+                        send(clientSock, tbfrRaw, sizeof(struct myACK)*j +
+                            sizeof(struct myDataPacket)*tlen, 0);
+                        mPORTDClearBits(BIT_2); // LED3=0
+                    }
                 }
             }
             else if (rlen < 0) 
@@ -398,64 +647,26 @@ int main()
                 clientSock = SOCKET_ERROR;
             }
 
-            // If rlen is zero length we increment delay count
-            else if (testStarted == 1)
+            // Retransmit only the frames whose own timer has run out. The
+            // wheel runs the timers every pass, so they go out on time
+            // even while frames keep coming in.
+            if (rlen >= 0 && testStarted == 1)
             {
-                DelayMsec(10);
-                delayCount++;
-                
-                // Check for ACK timeout
-                if (delayCount*10 > ACKTIMEOUT)
+                tlen = senderExpired(&sender, tbfr);
+                if (tlen > 0)
                 {
-                    // Retransmit any packets we haven't received ACKs back
-                    // for yet
-                    delayCount = 0;
-
-                    // Reset selective repeat
-                    selectiveRepeat = 0;
-
-                    // Set sequence number P to zero and send LENP 
-                    // packets
-                    for(i=0; i < tbfrDataTrackerI; i++)
-                    {
-                        flag = 0;
-                        for(j=0; j< tbfrAckTrackerI; j++)
-                        {
-                            if(tbfrDataTracker[i]==tbfrAckTracker[j])
-                            {
-                                flag = 1;
-                                break;
-                            }
-                        }
-                        if (flag == 0)
-                        {
-                            tbfr[selectiveRepeat++] = tbfr[i];
-                        }
-                    }
                     mPORTDClearBits(BIT_0);
                     mPORTDSetBits(BIT_2);   // LED3=1
                     send(clientSock, tbfr, 
-                        sizeof(struct myDataPacket)*selectiveRepeat, 0);
+                        sizeof(struct myDataPacket)*tlen, 0);
                     mPORTDClearBits(BIT_2); // LED3=0 
-                    DelayMsec(100);
-                    count++;
+                    count += tlen;
                 }
             }
         }   
     }
 }
 
-// Function : DelayMsec( )
-// 
-// Delays the program by specified millisecond passed
-void DelayMsec(unsigned int msec) 
-{
-    unsigned int tWait, tStart;
-    tWait = (SYS_FREQ / 2000) * msec;
-    tStart = ReadCoreTimer();
-    while ((ReadCoreTimer() - tStart) < tWait);
-}
-
 void generateAlphabet(struct myDataPacket *tbfrData, int tlen) 
 {
     // Loop tracker
@@ -463,6 +674,8 @@ void generateAlphabet(struct myDataPacket *tbfrData, int tlen)
 
     for(i=0; i < tlen; i++)
     {
+        tbfrData[i].type = FRAMEDATA;
+        tbfrData[i].length = DATAPAYLOAD;
         for(j=0; j < DATALEN; j++)
         {
             // We start populating data with ascii A
@@ -471,12 +684,111 @@ void generateAlphabet(struct myDataPacket *tbfrData, int tlen)
     }
 }
 
+// Length of the whole frame at the start of buf, which holds len bytes.
+// Returns 0 while the frame is not all in buf yet and -1 for a header no
+// frame has.
+int frameLength(const char *buf, int len)
+{
+    uint8_t type, length;
+
+    if (len < (int)sizeof(struct frameHeader)) return 0;
+    type = frameType(buf);
+    length = buf[offsetof(struct frameHeader, length)];
+    if (!(type == FRAMEDATA && length == DATAPAYLOAD) &&
+        !(type == FRAMEACK && length == ACKPAYLOAD))
+    {
+        return -1;
+    }
+    if (len < (int)sizeof(struct frameHeader) + length) return 0;
+    return sizeof(struct frameHeader) + length;
+}
+
+// Fields of a frame viewed in the receive ring. A frame can start at any
+// byte, so fields wider than a byte are copied out rather than loaded
+// through a cast pointer to the packed struct.
+uint8_t frameType(const char *frame)
+{
+    return frame[offsetof(struct frameHeader, type)];
+}
+
+uint32_t frameSequence(const char *frame)
+{
+    wireSeq sequence;
+
+    memcpy(&sequence, frame + offsetof(struct frameHeader, sequence),
+        sizeof(wireSeq));
+    return sequence;
+}
+
+char frameAckChar(const char *frame)
+{
+    return frame[offsetof(struct myACK, ackChar)];
+}
+
+void ringReset(struct rxRing *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Free space at tail that recvfrom can write in one piece. Sets len to its
+// size.
+char *ringSpace(struct rxRing *ring, int *len)
+{
+    unsigned int at = ring->tail % RXRING;
+    unsigned int space = RXRING - (ring->tail - ring->head);
+
+    *len = RXRING - at < space ? RXRING - at : space;
+    return ring->bytes + at;
+}
+
+// Adds the len bytes recvfrom wrote at ringSpace to the ring
+void ringCommit(struct rxRing *ring, int len)
+{
+    ring->tail += len;
+}
+
+// Byte after the '02' of an unframed command at head. Returns 0 while the
+// command is not all in yet and -1 if head holds none.
+int ringCommand(struct rxRing *ring)
+{
+    unsigned char command;
+
+    if (ring->tail - ring->head < 1) return 0;
+    if (ring->bytes[ring->head % RXRING] != 02) return -1;
+    if (ring->tail - ring->head < 2) return 0;
+    command = ring->bytes[(ring->head + 1) % RXRING];
+    return command != 0 ? command : -1;
+}
+
+// View of the whole frame at head, NULL while it is not all in yet. Sets
+// len to its length, or to -1 when head holds no valid frame. The part of
+// a frame that wrapped to the start of bytes is copied after the end, the
+// only copy a frame ever needs.
+char *ringFrame(struct rxRing *ring, int *len)
+{
+    unsigned int at = ring->head % RXRING;
+    unsigned int n = ring->tail - ring->head;
+
+    if (n > MAXFRAMELEN) n = MAXFRAMELEN;
+    if (at + n > RXRING) memcpy(ring->bytes + RXRING, ring->bytes, 
+        at + n - RXRING);
+    *len = frameLength(ring->bytes + at, n);
+    return *len > 0 ? ring->bytes + at : NULL;
+}
+
+// Frees the len bytes at head once their frame is handled
+void ringConsume(struct rxRing *ring, int len)
+{
+    ring->head += len;
+}
+
 double randMToN(double M, double N)
 {
     return M + (rand() / ( RAND_MAX / (N-M) ) ) ;  
 }
 
-void shuffle(uint8_t *array, size_t n)
+void shuffle(wireSeq *array, size_t n)
 {
     if (n > 1) 
     {
@@ -484,9 +796,730 @@ void shuffle(uint8_t *array, size_t n)
         for (i = 0; i < n - 1; i++) 
         {
           size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
-          int t = array[j];
+          wireSeq t = array[j];
           array[j] = array[i];
           array[i] = t;
         }
     }
-}
\ No newline at end of file
+}
+
+void rtoReset(struct rttEstimator *est)
+{
+    est->sampled = 0;
+    est->rto = ACKTIMEOUT*TICKSPERMSEC;
+}
+
+// Folds a round trip time in ticks into the estimate as in RFC 6298:
+// srtt moves 1/8 and rttvar 1/4 of the way to the new sample, and the
+// timeout is srtt + 4*rttvar kept within RTOMINMSEC and RTOMAXMSEC. A
+// sample also drops any backoff.
+void rtoSample(struct rttEstimator *est, unsigned int ticks)
+{
+    unsigned int rtoMax = RTOMAXMSEC*TICKSPERMSEC;
+    unsigned int delta;
+
+    if (ticks > rtoMax) ticks = rtoMax;
+    if (!est->sampled)
+    {
+        est->srtt = ticks;
+        est->rttvar = ticks/2;
+        est->sampled = 1;
+    }
+    else
+    {
+        delta = ticks > est->srtt ? ticks - est->srtt : est->srtt - ticks;
+        est->rttvar = est->rttvar - est->rttvar/4 + delta/4;
+        est->srtt = est->srtt - est->srtt/8 + ticks/8;
+    }
+
+    if (est->rttvar > (rtoMax - est->srtt)/4) est->rto = rtoMax;
+    else est->rto = est->srtt + 4*est->rttvar;
+    if (est->rto < RTOMINMSEC*TICKSPERMSEC)
+    {
+        est->rto = RTOMINMSEC*TICKSPERMSEC;
+    }
+}
+
+// Doubles the timeout after a retransmission, up to RTOMAXMSEC
+void rtoBackoff(struct rttEstimator *est)
+{
+    unsigned int rtoMax = RTOMAXMSEC*TICKSPERMSEC;
+
+    if (est->rto > rtoMax/2) est->rto = rtoMax;
+    else est->rto *= 2;
+}
+
+// Empties the wheel and starts it at the core timer value now. Timers
+// still linked into it must not be used again without timerInit.
+void wheelReset(struct timerWheel *wheel)
+{
+    memset(wheel->slot, 0, sizeof(wheel->slot));
+    wheel->now = 0;
+    wheel->due = ReadCoreTimer();
+    wheel->pending = 0;
+}
+
+// Links timer into the slot its expiry falls in, seen from now. Timers
+// beyond the reach of the wheel are pulled in to its last tick.
+void wheelInsert(struct timerWheel *wheel, struct wheelTimer *timer)
+{
+    struct wheelTimer **slot;
+    unsigned int delta = timer->expires - wheel->now;
+    int level = 0;
+
+    if (delta >> (WHEELBITS*WHEELLEVELS) != 0)
+    {
+        delta = (1u << (WHEELBITS*WHEELLEVELS)) - 1;
+        timer->expires = wheel->now + delta;
+    }
+    while (delta >> (WHEELBITS*(level+1)) != 0) level++;
+
+    slot = &wheel->slot[level][(timer->expires >> (WHEELBITS*level)) & 
+        WHEELMASK];
+    timer->next = *slot;
+    if (*slot != NULL) (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+// Runs the wheel up to core timer tick core. Each wheel tick due by then
+// first moves the timers of every higher level slot it starts down a
+// level, then runs the timers of its level 0 slot, which all expire at
+// that tick. Handlers may start and stop timers. Returns the number of
+// timers that ran out.
+int wheelService(struct timerWheel *wheel, unsigned int core)
+{
+    struct wheelTimer *due, *timer;
+    unsigned int skip;
+    int level, n = 0;
+
+    while ((int)(core - wheel->due) >= 0)
+    {
+        // With no timer running every tick up to core is empty
+        if (wheel->pending == 0)
+        {
+            skip = (core - wheel->due)/WHEELTICK + 1;
+            wheel->now += skip;
+            wheel->due += skip*WHEELTICK;
+            break;
+        }
+
+        for(level=1; level < WHEELLEVELS && ((wheel->now >> 
+                (WHEELBITS*(level-1))) & WHEELMASK) == 0; level++)
+        {
+            due = wheel->slot[level][(wheel->now >> (WHEELBITS*level)) & 
+                WHEELMASK];
+            wheel->slot[level][(wheel->now >> (WHEELBITS*level)) & 
+                WHEELMASK] = NULL;
+            while ((timer = due) != NULL)
+            {
+                due = timer->next;
+                wheelInsert(wheel, timer);
+            }
+        }
+
+        // Take the slot off the wheel before running it, so a timer its
+        // handlers start lands in the future
+        due = wheel->slot[0][wheel->now & WHEELMASK];
+        wheel->slot[0][wheel->now & WHEELMASK] = NULL;
+        if (due != NULL) due->pprev = &due;
+        wheel->now++;
+        wheel->due += WHEELTICK;
+        while ((timer = due) != NULL)
+        {
+            timerStop(wheel, timer);
+            if (timer->handler != NULL) timer->handler(timer);
+            n++;
+        }
+    }
+    return n;
+}
+
+// Sets timer up, not running, to call handler with it when it runs out.
+// A timer with no handler just stops running, which timerPending shows.
+void timerInit(struct wheelTimer *timer, 
+        void (*handler)(struct wheelTimer *timer), void *arg)
+{
+    timer->pprev = NULL;
+    timer->handler = handler;
+    timer->arg = arg;
+}
+
+// Starts timer, or restarts it if it runs, so it runs out the given number
+// of core timer ticks from now. It never runs out early. It runs out late
+// by less than a wheel tick plus however long the main loop takes to
+// call wheelService.
+void timerStart(struct timerWheel *wheel, struct wheelTimer *timer, 
+        unsigned int ticks)
+{
+    long long ahead;
+
+    timerStop(wheel, timer);
+
+    // Wheel ticks from now to the deadline, rounded up. The wheel may be
+    // behind the core timer if the loop was busy.
+    ahead = (long long)ticks + (int)(ReadCoreTimer() - wheel->due);
+    timer->expires = wheel->now;
+    if (ahead > 0) timer->expires += (ahead + WHEELTICK - 1)/WHEELTICK;
+    wheelInsert(wheel, timer);
+    wheel->pending++;
+}
+
+// Stops timer if it runs
+void timerStop(struct timerWheel *wheel, struct wheelTimer *timer)
+{
+    if (!timerPending(timer)) return;
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) timer->next->pprev = timer->pprev;
+    timer->pprev = NULL;
+    wheel->pending--;
+}
+
+int timerPending(struct wheelTimer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+// Sequence numbers run from 0 to SEQMASK and then roll over
+uint32_t sequenceOf(int msgIndex)
+{
+    return (uint32_t)msgIndex & SEQMASK;
+}
+
+// How far sequence number to is after from, mod 2^SEQBITS
+uint32_t seqOffset(uint32_t from, uint32_t to)
+{
+    return (to - from) & SEQMASK;
+}
+
+// RFC 1982 serial number comparison: a is before b if b is less than half
+// the sequence space after it
+int seqLess(uint32_t a, uint32_t b)
+{
+    uint32_t offset = seqOffset(a, b);
+
+    return offset != 0 && offset <= SEQMASK/2;
+}
+
+int bitGet(const uint32_t *bits, int i)
+{
+    return (bits[i/32] >> (i%32)) & 1;
+}
+
+void bitSet(uint32_t *bits, int i)
+{
+    bits[i/32] |= 1u << (i%32);
+}
+
+void bitClear(uint32_t *bits, int i)
+{
+    bits[i/32] &= ~(1u << (i%32));
+}
+
+// Runs the frame timers of the sender on wheel. Called once before the
+// first senderReset.
+void senderInit(struct srSender *sender, struct timerWheel *wheel)
+{
+    int i;
+
+    sender->wheel = wheel;
+    for(i=0; i < LENP; i++)
+    {
+        timerInit(&sender->slot[i].timer, frameTimedOut, sender);
+    }
+}
+
+void senderReset(struct srSender *sender)
+{
+    int i;
+
+    sender->base = 0;
+    sender->next = 0;
+    memset(sender->acked, 0, sizeof(sender->acked));
+    memset(sender->due, 0, sizeof(sender->due));
+    for(i=0; i < LENP; i++)
+    {
+        timerStop(sender->wheel, &sender->slot[i].timer);
+    }
+}
+
+// Handler of a frame timer. Marks its slot due for a resend, which
+// senderExpired makes.
+void frameTimedOut(struct wheelTimer *timer)
+{
+    struct srSender *sender = timer->arg;
+    struct txSlot *slot = (struct txSlot *)((char *)timer - 
+        offsetof(struct txSlot, timer));
+
+    bitSet(sender->due, slot - sender->slot);
+}
+
+// Moves the frames the window has room for into their slots, starts their
+// timers and copies them to tbfr for sending. Returns the number of
+// frames copied.
+int senderFill(struct srSender *sender, struct myDataPacket *tbfrData,
+        struct myDataPacket *tbfr)
+{
+    struct txSlot *slot;
+    int n = 0;
+
+    while (sender->next < sender->base + LENP && sender->next < MSGLEN)
+    {
+        slot = &sender->slot[sender->next % LENP];
+        tbfrData[sender->next].sequence = sequenceOf(sender->next);
+        slot->packet = tbfrData[sender->next];
+        slot->resent = 0;
+        slot->sentAt = ReadCoreTimer();
+        timerStart(sender->wheel, &slot->timer, sender->rtt.rto);
+        tbfr[n++] = slot->packet;
+        sender->next++;
+    }
+    return n;
+}
+
+// Marks the frame in flight with this sequence number as ACKed and slides
+// the window past every ACKed frame at its start. The offset of the frame
+// in the window comes straight from the sequence number. By Karn's rule
+// only frames sent once give an RTT sample, since the ACK of a resent
+// frame may belong to either send. Returns 0 for an ACK of a frame not in
+// flight or already ACKed, which changes nothing.
+int senderAck(struct srSender *sender, uint32_t sequence)
+{
+    struct txSlot *slot;
+    uint32_t offset;
+    int i, run;
+
+    offset = seqOffset(sequenceOf(sender->base), sequence);
+    if (offset >= (uint32_t)(sender->next - sender->base)) return 0;
+    i = (sender->base + offset) % LENP;
+    if (bitGet(sender->acked, i)) return 0;
+
+    bitSet(sender->acked, i);
+    bitClear(sender->due, i);
+    slot = &sender->slot[i];
+    timerStop(sender->wheel, &slot->timer);
+    if (!slot->resent)
+    {
+        rtoSample(&sender->rtt, ReadCoreTimer() - slot->sentAt);
+    }
+
+    // Slide a word at a time over the run of ACKed frames at base
+    while (sender->base < sender->next)
+    {
+        i = sender->base % LENP;
+        run = findFirstZero(sender->acked[i/32] >> (i%32));
+        if (run > 32 - i%32) run = 32 - i%32;
+        if (run > LENP - i) run = LENP - i;
+        if (run > sender->next - sender->base)
+        {
+            run = sender->next - sender->base;
+        }
+        if (run == 0) break;
+        sender->acked[i/32] &= ~((run < 32 ? (1u << run) - 1 : ~0u) << (i%32));
+        sender->base += run;
+    }
+    return 1;
+}
+
+// Index of the lowest zero bit, 32 if there is none. The compiler turns
+// the count of trailing zeros into a clz on the PIC32.
+int findFirstZero(uint32_t bits)
+{
+    if (~bits == 0) return 32;
+    return __builtin_ctz(~bits);
+}
+
+// Copies every frame whose timer has run out to tbfr and restarts its
+// timer with the timeout doubled. Only the slots marked in due are looked
+// at, a word of the bitmap at a time. Returns the number of frames copied.
+int senderExpired(struct srSender *sender, struct myDataPacket *tbfr)
+{
+    struct txSlot *slot;
+    int w, n = 0;
+
+    for(w=0; w < LENPWORDS; w++)
+    {
+        while (sender->due[w])
+        {
+            slot = &sender->slot[w*32 + findFirstZero(~sender->due[w])];
+            sender->due[w] &= sender->due[w] - 1;
+            if (n == 0) rtoBackoff(&sender->rtt);
+            slot->resent = 1;
+            timerStart(sender->wheel, &slot->timer, sender->rtt.rto);
+            tbfr[n++] = slot->packet;
+        }
+    }
+    return n;
+}
+
+void receiverReset(struct srReceiver *receiver)
+{
+    memset(receiver->present, 0, sizeof(receiver->present));
+    receiver->expected = sequenceOf(0);
+    receiver->delivered = 0;
+}
+
+// Buffers a received frame, viewed where it lies in the receive ring, in
+// the slot its sequence number puts it in.
+// Returns 1 for a new frame, 0 for a duplicate, which should be ACKed
+// again but is not stored, and -1 for a frame outside the window, which is
+// dropped. The LENP sequence numbers before expected are the previous
+// window.
+int receiverAccept(struct srReceiver *receiver, const char *frame)
+{
+    uint32_t sequence = frameSequence(frame);
+    uint32_t offset;
+    int i;
+
+    if (seqLess(sequence, receiver->expected))
+    {
+        offset = seqOffset(sequence, receiver->expected);
+        return offset <= LENP ? 0 : -1;
+    }
+    offset = seqOffset(receiver->expected, sequence);
+    if (offset >= LENP) return -1;
+    i = (receiver->delivered + offset) % LENP;
+    if (bitGet(receiver->present, i)) return 0;
+
+    memcpy(&receiver->slot[i], frame, sizeof(struct myDataPacket));
+    bitSet(receiver->present, i);
+    return 1;
+}
+
+// Copies the payloads of the run of frames starting at expected into msg,
+// up to maxLen chars, and frees their slots. Returns the number of chars
+// delivered.
+int receiverDeliver(struct srReceiver *receiver, char *msg, int maxLen)
+{
+    int i, len = 0;
+
+    i = receiver->delivered % LENP;
+    while (bitGet(receiver->present, i) && len + DATALEN <= maxLen)
+    {
+        memcpy(msg+len, receiver->slot[i].data, DATALEN);
+        len += DATALEN;
+        bitClear(receiver->present, i);
+        receiver->delivered++;
+        receiver->expected = sequenceOf(receiver->delivered);
+        i = receiver->delivered % LENP;
+    }
+    return len;
+}
+
+// Sends the message SIMPASSES times from an srSender to an srReceiver
+// over a channel that loses each frame with 10% and 30% chance. Every
+// round sends the new frames and resends the holes of the window, so a
+// lost early frame arrives after the frames behind it. Each loss rate is
+// run with the reorder buffer and again with a receiver that drops and
+// does not ACK any frame ahead of the one it expects. Appends the frames
+// sent, the rounds (round trips) per message, the out of order frames
+// kept, whether the message came out intact and in order, and the
+// receiver cycles per frame.
+int reorderBenchmark(char *report)
+{
+    static const int lossRates[2] = {10, 30};
+    struct myDataPacket data[MSGLEN], tbfr[LENP];
+    struct srSender sender;
+    struct srReceiver receiver;
+    struct timerWheel wheel;
+    char msg[MSGLEN*DATALEN];
+    unsigned int tStart, ticks;
+    int sent, rounds, kept, intact, msgLen, accepted;
+    int r, buffered, pass, n, i, m, len = 0;
+
+    // The frame timers are never run here, each round resends the holes
+    generateAlphabet(data, MSGLEN);
+    wheelReset(&wheel);
+    senderInit(&sender, &wheel);
+    len += sprintf(report+len, "loss%% buffer sent rounds kept-out-of-order "
+            "intact cycles/frame\r\n");
+    for(r=0; r < 2; r++)
+    {
+        for(buffered=1; buffered >= 0; buffered--)
+        {
+            srand(1);
+            sent = 0;
+            rounds = 0;
+            kept = 0;
+            intact = 1;
+            ticks = 0;
+            for(pass=0; pass < SIMPASSES; pass++)
+            {
+                senderReset(&sender);
+                rtoReset(&sender.rtt);
+                receiverReset(&receiver);
+                msgLen = 0;
+                while (sender.base < MSGLEN)
+                {
+                    rounds++;
+
+                    // Holes of the window first, then the new frames
+                    n = 0;
+                    for(m=sender.base; m < sender.next; m++)
+                    {
+                        if (!bitGet(sender.acked, m % LENP))
+                        {
+                            tbfr[n++] = sender.slot[m % LENP].packet;
+                        }
+                    }
+                    n += senderFill(&sender, data, tbfr+n);
+
+                    for(i=0; i < n; i++)
+                    {
+                        sent++;
+                        if (rand() % 100 < lossRates[r]) continue;
+                        if (!buffered &&
+                                seqLess(receiver.expected, tbfr[i].sequence))
+                        {
+                            continue;
+                        }
+
+                        tStart = ReadCoreTimer();
+                        accepted = receiverAccept(&receiver, 
+                            (const char *) &tbfr[i]);
+                        if (accepted > 0 &&
+                                tbfr[i].sequence != receiver.expected)
+                        {
+                            kept++;
+                        }
+                        msgLen += receiverDeliver(&receiver, msg+msgLen, 
+                                sizeof(msg)-msgLen);
+                        ticks += ReadCoreTimer() - tStart;
+
+                        if (accepted >= 0)
+                        {
+                            senderAck(&sender, tbfr[i].sequence);
+                        }
+                    }
+                }
+                for(i=0; i < MSGLEN*DATALEN; i++)
+                {
+                    if (msgLen != MSGLEN*DATALEN || 
+                            msg[i] != data[i/DATALEN].data[i%DATALEN])
+                    {
+                        intact = 0;
+                    }
+                }
+            }
+            len += sprintf(report+len, "%d %s %d %d.%02d %d %s %u\r\n",
+                    lossRates[r], buffered ? "yes" : "no", sent,
+                    rounds/SIMPASSES, rounds*100/SIMPASSES % 100, kept,
+                    intact ? "yes" : "no", 2*ticks/(SIMPASSES*MSGLEN));
+        }
+    }
+    return len;
+}
+
+// Simulated goodput in bytes/s of the old sender: LENP frames at a time,
+// the next batch only once all of them are ACKed, and one timer that every
+// received message restarts and that resends all unACKed frames when it
+// runs out. Time is kept in msec.
+int batchGoodput(int lossPct)
+{
+    uint8_t acked[LENP];
+    int t = 0, sendTime, lastRx;
+    int done, batch, left, i;
+
+    for(done=0; done < SIMFRAMES; done+=batch)
+    {
+        batch = SIMFRAMES-done < LENP ? SIMFRAMES-done : LENP;
+        memset(acked, 0, sizeof(acked));
+        sendTime = t;
+        while (1)
+        {
+            left = 0;
+            lastRx = -1;
+            for(i=0; i < batch; i++)
+            {
+                if (acked[i]) continue;
+                if (rand() % 100 >= lossPct)
+                {
+                    acked[i] = 1;
+                    lastRx = sendTime + SIMRTTMS;
+                }
+                else left++;
+            }
+            if (left == 0)
+            {
+                t = sendTime + SIMRTTMS;
+                break;
+            }
+            sendTime = (lastRx >= 0 ? lastRx : sendTime) + ACKTIMEOUT;
+        }
+    }
+    return (int)((long long)SIMFRAMES*DATALEN*1000 / t);
+}
+
+// Simulated goodput in bytes/s of the sliding window with a timer per
+// frame. Every frame in flight has the time of its next event: its ACK if
+// it got through, its timeout if not. The earliest event is handled next.
+// The timeout is ACKTIMEOUT, or with adaptive set the RTO of an estimator
+// fed the same samples and backoffs as the real sender.
+int windowGoodput(int lossPct, int adaptive)
+{
+    int event[LENP];
+    uint8_t delivered[LENP], acked[LENP], resent[LENP];
+    struct rttEstimator est;
+    int base = 0, next = 0, t = 0;
+    int m, e, timeout;
+
+    rtoReset(&est);
+
+    while (base < SIMFRAMES)
+    {
+        timeout = adaptive ? est.rto/TICKSPERMSEC : ACKTIMEOUT;
+
+        // Send whatever the window has room for
+        for(; next < base + LENP && next < SIMFRAMES; next++)
+        {
+            delivered[next % LENP] = rand() % 100 >= lossPct;
+            acked[next % LENP] = 0;
+            resent[next % LENP] = 0;
+            event[next % LENP] = t + (delivered[next % LENP] ? SIMRTTMS :
+                    timeout);
+        }
+
+        e = -1;
+        for(m=base; m < next; m++)
+        {
+            if (!acked[m % LENP] && (e < 0 || event[m % LENP] < event[e]))
+            {
+                e = m % LENP;
+            }
+        }
+        t = event[e];
+
+        if (delivered[e])
+        {
+            acked[e] = 1;
+            if (!resent[e]) rtoSample(&est, SIMRTTMS*TICKSPERMSEC);
+            while (base < next && acked[base % LENP]) base++;
+        }
+        else
+        {
+            // Timed out, resend just this frame
+            rtoBackoff(&est);
+            resent[e] = 1;
+            timeout = adaptive ? est.rto/TICKSPERMSEC : ACKTIMEOUT;
+            delivered[e] = rand() % 100 >= lossPct;
+            event[e] = t + (delivered[e] ? SIMRTTMS : timeout);
+        }
+    }
+    return (int)((long long)SIMFRAMES*DATALEN*1000 / t);
+}
+
+// Writes the simulated goodput of the senders at each loss rate into
+// report. Returns the report length.
+int goodputBenchmark(char *report)
+{
+    static const int lossRates[SIMLOSSRATES] = {1, 10, 30};
+    int r, batch, window, adaptive, len = 0;
+
+    len += sprintf(report+len, "loss%% B/s batch window adaptive\r\n");
+    for(r=0; r < SIMLOSSRATES; r++)
+    {
+        srand(1);
+        batch = batchGoodput(lossRates[r]);
+        srand(1);
+        window = windowGoodput(lossRates[r], 0);
+        srand(1);
+        adaptive = windowGoodput(lossRates[r], 1);
+        len += sprintf(report+len, "%d %d %d %d\r\n", lossRates[r], batch, 
+                window, adaptive);
+    }
+    return len;
+}
+
+// Handler of a timer of the timer benchmark. Notes how late it ran.
+void probeExpired(struct wheelTimer *timer)
+{
+    struct probeTimer *probe = (struct probeTimer *) timer;
+    struct probeStats *stats = timer->arg;
+    int late = (int)(ReadCoreTimer() - probe->deadline);
+
+    stats->fired++;
+    if (late < 0)
+    {
+        stats->early++;
+        return;
+    }
+    stats->lateSum += late;
+    if ((unsigned int)late > stats->lateMax) stats->lateMax = late;
+}
+
+// Starts TIMERPROBES timers on a wheel of its own and then services the
+// stack and the wheel as the main loop does until all of them ran out.
+// Appends the mean and worst lateness of the timers in usec, the number
+// that ran early, how often TCPIPProcess ran meanwhile and the longest
+// gap in usec between two of its runs. Returns the report length.
+int timerBenchmark(char *report)
+{
+    static struct probeTimer probe[TIMERPROBES];
+    struct probeStats stats = {0, 0, 0, 0};
+    struct timerWheel wheel;
+    unsigned int ticks, now, last, gap = 0;
+    int i, polls = 0;
+
+    srand(1);
+    wheelReset(&wheel);
+    for(i=0; i < TIMERPROBES; i++)
+    {
+        ticks = (unsigned int) randMToN(0.0, TIMERSPANMSEC*TICKSPERMSEC);
+        timerInit(&probe[i].timer, probeExpired, &stats);
+        probe[i].deadline = ReadCoreTimer() + ticks;
+        timerStart(&wheel, &probe[i].timer, ticks);
+    }
+
+    last = ReadCoreTimer();
+    while (stats.fired < TIMERPROBES)
+    {
+        TCPIPProcess();
+        DHCPTask();
+        polls++;
+        now = ReadCoreTimer();
+        if (now - last > gap) gap = now - last;
+        last = now;
+        wheelService(&wheel, now);
+    }
+
+    return sprintf(report, "timers late-us max-late-us early polls "
+            "max-gap-us\r\n%d %u %u %d %d %u\r\n", TIMERPROBES,
+            (unsigned int)(stats.lateSum/TIMERPROBES/(TICKSPERMSEC/1000)),
+            stats.lateMax/(TICKSPERMSEC/1000), stats.early, polls,
+            gap/(TICKSPERMSEC/1000));
+}
+
+// Runs the animation timer of led on wheel. Called once before the first
+// ledStart.
+void ledInit(struct ledAnimation *led, struct timerWheel *wheel)
+{
+    led->wheel = wheel;
+    timerInit(&led->timer, ledStep, led);
+}
+
+// Starts led over with pattern, cutting short any animation still showing
+void ledStart(struct ledAnimation *led, const unsigned int *pattern, 
+        int steps)
+{
+    if (timerPending(&led->timer)) mPORTDClearBits(led->pattern[led->step]);
+    led->pattern = pattern;
+    led->steps = steps;
+    led->step = 0;
+    mPORTDSetBits(pattern[0]);
+    timerStart(led->wheel, &led->timer, LEDSTEPMSEC*TICKSPERMSEC);
+}
+
+// Handler of the animation timer. Moves to the next step and clears the
+// LEDs after the last.
+void ledStep(struct wheelTimer *timer)
+{
+    struct ledAnimation *led = timer->arg;
+
+    mPORTDClearBits(led->pattern[led->step]);
+    led->step++;
+    if (led->step < led->steps)
+    {
+        mPORTDSetBits(led->pattern[led->step]);
+        timerStart(led->wheel, timer, LEDSTEPMSEC*TICKSPERMSEC);
+    }
+}
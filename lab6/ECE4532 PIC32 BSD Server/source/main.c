@@ -22,6 +22,8 @@
 
 
 #include <string.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <time.h>
 #include <plib.h>		// PIC32 Peripheral library functions and macros
 #include "tcpip_bsd_config.h"	// in \source
@@ -39,53 +41,317 @@
 // Project specific constants
 #define MSGLEN 26
 #define DATALEN 16
-#define LENM 15
-#define FRAMEDELAY 3
+#define LENM 15 // Send window. At most half of the sequence space
+
+// Descriptors in the send window ring, a power of two of at least LENM
+#define TXRING 16
+#define TXRINGMASK (TXRING-1)
+#if TXRING < LENM || (TXRING & TXRINGMASK) != 0
+#error TXRING must be a power of two of at least LENM
+#endif
+
+// Sequence numbers are SEQBITS wide, up to 32, and wrap to zero. They are
+// compared as in RFC 1982, by their distance mod 2^SEQBITS, which only
+// orders two numbers less than half the space apart.
+#define SEQBITS 8
+#define SEQMASK (0xFFFFFFFFu >> (32-SEQBITS))
+#if LENM > (1 << (SEQBITS-1))
+#error LENM must be at most half of the 2^SEQBITS sequence space
+#endif
+
+// Receive ring size, a power of two, and send buffer size. Everything one
+// pass of the loop sends goes out together when it fits in the send
+// buffer. MAXFRAMELEN is how far a frame can run past the end of the ring.
+#define RXRING 512
+#define TXLEN 512
+#define MAXFRAMELEN sizeof(myDataPacket)
+
+// Frame types of the frame header
+#define FRAMEDATA 0x01
+#define FRAMEACK 0x06
+
+#define FRAMEDELAY 3 // In order frames one cumulative ACK covers at most
+#define ACKDELAYMSEC 10 // Longest a received frame waits for its ACK
 #define PROBSENTERR 0.5
 #define PROBACKERR 0.0
 
-#define TRANSMISSIONDELAY 100 // Time to wait between data transmissions
-#define ACKTIMEOUT 1000 // In MSEC. Time to wait before 
+#define TRANSMISSIONDELAY 0 // In MSEC. Least time between data frames, 0
+                            // sends as fast as the window allows
+
+// True once the next data frame may follow one sent at core time t. An
+// unpaced build skips the test, which could only compare against zero.
+#if TRANSMISSIONDELAY > 0
+#define SENDDUE(t) (ReadCoreTimer() - (t) >= TRANSMISSIONDELAY*TICKSPERMSEC)
+#else
+#define SENDDUE(t) 1
+#endif
+#define ACKTIMEOUT 1000 // In MSEC. Timeout until the first RTT sample
+#define RTOMINMSEC 10
+#define RTOMAXMSEC 60000u // In ticks this only fits an unsigned int
+
+// Core timer ticks per millisecond. The core timer runs at SYS_FREQ/2.
+#define TICKSPERMSEC (SYS_FREQ/2000)
+
+// Frame rate simulation of the '0266' benchmark. PACEDGAPMS is the time
+// between frames of the old sender: 11 polls of DelayMsec(10) before a
+// frame and DelayMsec(100) after it. Frame loss rates are in percent.
+#define SIMFRAMES 1000
+#define SIMRTTMS 20
+#define SIMLOSSRATES 3
+#define PACEDGAPMS 210
+#define SIMACKS (2*LENM+16)
+
+// Timer wheel. A wheel tick is WHEELTICK core timer ticks and each of the
+// WHEELLEVELS levels has WHEELSLOTS slots, a slot of level l spanning
+// WHEELSLOTS^l wheel ticks. Timers reach up to WHEELSLOTS^WHEELLEVELS wheel
+// ticks ahead, which covers RTOMAXMSEC.
+#define WHEELTICK TICKSPERMSEC
+#define WHEELBITS 6
+#define WHEELSLOTS (1 << WHEELBITS)
+#define WHEELMASK (WHEELSLOTS-1)
+#define WHEELLEVELS 3
+
+// Timer benchmark of the '0266' report. TIMERPROBES timers run out at
+// random within TIMERSPANMSEC.
+#define TIMERPROBES 1000
+#define TIMERSPANMSEC 1000
+
+// Time each step of an LED animation lasts
+#define LEDSTEPMSEC 50
+
+// 1 runs the connect animation to the end before the client is served,
+// like the old DelayMsec blink, so setup-us can be compared both ways
+#define LEDBLOCKING 0
 
 // We create structs for our message format
 // For explanation of pragma see:
 // http://stackoverflow.com/questions/1577161/passing-a-structure-through-sockets-in-c
+// Smallest type that holds a sequence number on the wire
+#if SEQBITS <= 8
+typedef uint8_t wireSeq;
+#elif SEQBITS <= 16
+typedef uint16_t wireSeq;
+#else
+typedef uint32_t wireSeq;
+#endif
+
 #pragma pack(1)
 
-// ACK Struct
+// Every frame starts with this header. length counts the bytes after the
+// header, so frames of any type can follow each other in one buffer.
+typedef struct frameHeader
+{
+    uint8_t type;
+    uint8_t length;
+    wireSeq sequence;
+} frameHeader;
+
+// ACK Struct. Starts with the frameHeader fields.
 typedef struct myACK
 {
-    uint8_t sequence;
+    uint8_t type;
+    uint8_t length;
+    wireSeq sequence;
     char ackChar;
 } myACK;
 
-// WARNING IF myDataPacket length and myACKs are multiples of one another,
-// the packet detection algo will fail. 
+// Data Struct. Starts with the frameHeader fields.
 typedef struct myDataPacket 
 {
-    uint8_t sequence;
+    uint8_t type;
+    uint8_t length;
+    wireSeq sequence;
     char data[DATALEN];
 } myDataPacket;
 #pragma pack(0) // turn packing off
 
-typedef struct Queue
+// Payload lengths the header of each frame type must carry
+#define ACKPAYLOAD (sizeof(myACK) - sizeof(frameHeader))
+#define DATAPAYLOAD (sizeof(myDataPacket) - sizeof(frameHeader))
+
+// Frames waiting to go out together in one send
+typedef struct txBatch
+{
+    char bytes[TXLEN];
+    int len;
+} txBatch;
+
+// Receive ring. recvfrom writes straight into the free space at tail and
+// frames are parsed where they lie from head. Both count bytes since the
+// reset and are taken mod RXRING when used. The MAXFRAMELEN bytes after
+// the end repeat the start of bytes while a frame runs past the end, so
+// every frame can be viewed in one piece.
+typedef struct rxRing
+{
+    char bytes[RXRING + MAXFRAMELEN];
+    unsigned int head;
+    unsigned int tail;
+} rxRing;
+
+// Retransmission timeout estimator. srtt and rttvar are the smoothed
+// round trip time and its mean deviation in core timer ticks, rto is the
+// timeout they give.
+typedef struct rttEstimator
+{
+    unsigned int srtt;
+    unsigned int rttvar;
+    unsigned int rto;
+    uint8_t sampled;
+} rttEstimator;
+
+// ACKs in flight in the frame rate simulation. at is the arrival time of
+// each ACK and frame the message index it covers, or for a NAK the index
+// it asks for.
+typedef struct simAcks
+{
+    int at[SIMACKS];
+    int frame[SIMACKS];
+    uint8_t nak[SIMACKS];
+    int head;
+    int tail;
+    int sent;
+} simAcks;
+
+// One run of the go-back-N simulation. The first five fields set up the
+// link and receiver, the last three hold the results.
+typedef struct gbnSim
+{
+    int lossPct;
+    int ackLossPct;
+    int gapMsec;
+    int coalesce;
+    int nak;
+    int framesPerSec;
+    int acksPer100;
+    int recoveryMsec;
+} gbnSim;
+
+// Descriptor of an unACKed frame. packet points at the frame where it was
+// built in tbfrData, so every resend goes out from there. sentAt is the
+// core timer tick of its last send and resent is set once it went out
+// more than once.
+typedef struct txDesc
+{
+    myDataPacket *packet;
+    unsigned int sentAt;
+    uint8_t resent;
+} txDesc;
+
+// Send window. Descriptors head to tail-1 are the unACKed frames, oldest
+// first, and those before next went out since the last go back. The
+// indexes count descriptors and are masked to the ring when used.
+typedef struct txRing
+{
+    txDesc desc[TXRING];
+    unsigned int head;
+    unsigned int next;
+    unsigned int tail;
+} txRing;
+
+// Timer of the timer wheel. While it runs it is linked into a slot list
+// by next and pprev, which points at the link to it, and pprev is NULL
+// otherwise. expires is the wheel tick it runs out at, when handler is
+// called with it.
+typedef struct wheelTimer
+{
+    struct wheelTimer *next;
+    struct wheelTimer **pprev;
+    unsigned int expires;
+    void (*handler)(struct wheelTimer *timer);
+    void *arg;
+} wheelTimer;
+
+// Hierarchical timer wheel on the core timer. now is the next wheel tick
+// to run and due the core timer tick it is due at. A timer that runs out
+// within WHEELSLOTS wheel ticks sits in the level 0 slot of its tick, any
+// other in the lowest level that reaches it, and drops a level whenever
+// now gets to the start of its slot. pending counts the running timers.
+typedef struct timerWheel
+{
+    wheelTimer *slot[WHEELLEVELS][WHEELSLOTS];
+    unsigned int now;
+    unsigned int due;
+    int pending;
+} timerWheel;
+
+// LED animation run by a wheel timer instead of waited out. Step i lights
+// the LEDs in pattern[i] for LEDSTEPMSEC. step is the step showing while
+// timer runs.
+typedef struct ledAnimation
+{
+    wheelTimer timer;
+    timerWheel *wheel;
+    const unsigned int *pattern;
+    int steps;
+    int step;
+} ledAnimation;
+
+// A new connection runs LED1 to LED3
+const unsigned int ledConnect[3] = {BIT_0, BIT_1, BIT_2};
+
+// A timer of the timer benchmark and the core timer tick it is due at
+typedef struct probeTimer
+{
+    wheelTimer timer;
+    unsigned int deadline;
+} probeTimer;
+
+// Results of the timer benchmark. Lateness is in core timer ticks.
+typedef struct probeStats
 {
-        int capacity;
-        int size;
-        int front;
-        int rear;
-        int *elements;
-} Queue;
+    int fired;
+    int early;
+    unsigned int lateMax;
+    long long lateSum;
+} probeStats;
 
-void DelayMsec(unsigned int msec);
 void generateAlphabet(myDataPacket *tbfrData, int tlen) ;
 double randMToN(double M, double N);
-Queue * createQueue(int maxElements);
-void Dequeue(Queue *Q);
-int front(Queue *Q);
-int rear(Queue *Q);
-void Enqueue(Queue *Q, int element);
-void clearQueue(Queue *Q);
+void txReset(txRing *ring);
+int txCount(txRing *ring);
+txDesc *txPush(txRing *ring, myDataPacket *packet);
+txDesc *txAt(txRing *ring, int i);
+txDesc *txNext(txRing *ring);
+void txPop(txRing *ring, int n);
+void txRewind(txRing *ring);
+int findInWindow(txRing *tbfrWindow, uint32_t sequence);
+uint32_t seqAdd(uint32_t sequence, int n);
+uint32_t seqOffset(uint32_t from, uint32_t to);
+int seqLess(uint32_t a, uint32_t b);
+void sendAck(SOCKET sock, txBatch *batch, uint32_t sequence, char ackChar);
+int frameLength(const char *buf, int len);
+uint8_t frameType(const char *frame);
+uint32_t frameSequence(const char *frame);
+char frameAckChar(const char *frame);
+void ringReset(rxRing *ring);
+char *ringSpace(rxRing *ring, int *len);
+void ringCommit(rxRing *ring, int len);
+int ringCommand(rxRing *ring);
+char *ringFrame(rxRing *ring, int *len);
+void ringConsume(rxRing *ring, int len);
+void batchAdd(SOCKET sock, txBatch *batch, const void *frame, int len);
+void batchFlush(SOCKET sock, txBatch *batch);
+void rtoReset(rttEstimator *est);
+void rtoSample(rttEstimator *est, unsigned int ticks);
+void rtoRestore(rttEstimator *est);
+void rtoBackoff(rttEstimator *est);
+void wheelReset(timerWheel *wheel);
+void wheelInsert(timerWheel *wheel, wheelTimer *timer);
+int wheelService(timerWheel *wheel, unsigned int core);
+void timerInit(wheelTimer *timer, void (*handler)(wheelTimer *timer), 
+        void *arg);
+void timerStart(timerWheel *wheel, wheelTimer *timer, unsigned int ticks);
+void timerStop(timerWheel *wheel, wheelTimer *timer);
+int timerPending(wheelTimer *timer);
+void simAckSend(simAcks *acks, int t, int frame, int nak, int ackLossPct);
+void gbnSimulate(gbnSim *sim);
+int frameRateBenchmark(char *report);
+void ledInit(ledAnimation *led, timerWheel *wheel);
+void ledStart(ledAnimation *led, const unsigned int *pattern, 
+        int steps);
+void ledStep(wheelTimer *timer);
+void probeExpired(wheelTimer *timer);
+int timerBenchmark(char *report);
 
 int main()
 {
@@ -93,31 +359,64 @@ int main()
     SOCKET serverSock, clientSock = INVALID_SOCKET;
     IP_ADDR curr_ip, ip;
     
-    // Delay interaction counter
-    int ackDelayCount = 0;
-    int transDelayCount = 0;
-    
     // Initialize buffer length variables
     int tlen, rlen;
+
+    // Frame parsing. frame is a view of the frame being parsed in
+    // rbfrRing and flen its length. command is the byte after an '02'.
+    char *frame;
+    int flen;
+    int command = 0;
     
     // Initialize the buffers for server
-    myDataPacket *rbfrData;
-    myACK rbfrAck;
-    char rbfrRaw[256] = {0};
-    Queue *rbfrDataQueue = createQueue(FRAMEDELAY);
-    uint8_t rbfrSeqTracker = 0;
+    rxRing rbfrRing;
+    char *rbfrSpace;
+    int rbfrSpaceLen;
+    uint32_t rbfrSeqTracker = 0;
+
+    // In order frames not ACKed yet. While rbfrAckDue is set an ACK goes
+    // out by the time rbfrAckTimer runs out at the latest.
+    int rbfrAckPending = 0;
+    uint8_t rbfrAckDue = 0;
+    wheelTimer rbfrAckTimer;
+
+    // Set once a NAK went out for the frame at rbfrSeqTracker
+    uint8_t rbfrNakSent = 0;
 
     // Initialize the buffers for client
     myDataPacket tbfrData[MSGLEN];
-    myACK *tbfrAck;
-    myDataPacket tbfr;
-    Queue *tbfrAckQueue = createQueue(LENM);
-    uint8_t tbfrSeqTracker = 0;
+    txBatch tbfrBatch = {{0}, 0};
+    txRing tbfrWindow;
+    txDesc *desc;
+    uint32_t tbfrSeqTracker = 0;
     uint8_t testStarted = 0;
+
+    // ACK timer. ackTimer runs out when the oldest frame in tbfrWindow
+    // times out.
+    rttEstimator rtt;
+    wheelTimer ackTimer;
+    unsigned int lastSentAt = 0;
+    int acked;
+
+    // msgSent at the last go back. A NAK for a frame before tbfrRecover
+    // may come from duplicates the go back caused, so it does not trigger
+    // another.
+    int tbfrRecover = 0;
     
     // Message progress (expirment) trackers
     int msgSent = 0;
-    int endMsg = 0;
+    char report[512];
+
+    // Every timer runs on this wheel, which the loop services each pass.
+    // The loop checks timerPending to see which of the protocol timers ran
+    // out.
+    timerWheel wheel;
+
+    // LED animation, and how long in core timer ticks the last client
+    // waited from accept until its first message was read
+    ledAnimation led;
+    unsigned int acceptedAt, setupTicks = 0;
+    int setupPending = 0;
 
     // Socket struct descriptor
     struct sockaddr_in addr;
@@ -172,6 +471,11 @@ int main()
     // We create our transmission data using the alphabet. 26 packets total
     tlen = MSGLEN;
     generateAlphabet(tbfrData, tlen);
+    txReset(&tbfrWindow);
+    wheelReset(&wheel);
+    timerInit(&ackTimer, NULL, NULL);
+    timerInit(&rbfrAckTimer, NULL, NULL);
+    ledInit(&led, &wheel);
     
     // Loop forever
     while (1) 
@@ -180,6 +484,9 @@ int main()
         TCPIPProcess();
         DHCPTask();
 
+        // Stop the timers that ran out
+        wheelService(&wheel, ReadCoreTimer());
+
         // set the machines IP address and save to variable
         ip.Val = TCPIPGetIPAddr();
 
@@ -196,144 +503,205 @@ int main()
             // Upon connection to a client blink LEDS.
             if (clientSock != INVALID_SOCKET) 
             {
+                acceptedAt = ReadCoreTimer();
+                setupPending = 1;
                 setsockopt(clientSock, SOL_SOCKET, TCP_NODELAY, 
                     (char*)&tlen, sizeof(int));
-                mPORTDSetBits(BIT_0); // LED1=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_0); // LED1=0
-                mPORTDSetBits(BIT_1); // LED2=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_1); // LED2=0
-                mPORTDSetBits(BIT_2); // LED3=1
-                DelayMsec(50);
-                mPORTDClearBits(BIT_2); // LED3=0
+                // Every new link starts from the initial timeout and an
+                // empty receive ring
+                rtoReset(&rtt);
+                ringReset(&rbfrRing);
+                ledStart(&led, ledConnect, 3);
+#if LEDBLOCKING
+                while (timerPending(&led.timer))
+                {
+                    wheelService(&wheel, ReadCoreTimer());
+                }
+#endif
             }
         } 
         else 
         {
             // We are connected to a client already. We start
-            // by receiving the message being sent by the client
-            rlen = recvfrom(clientSock, rbfrRaw, sizeof (rbfrRaw), 0, NULL,
+            // by receiving the message being sent by the client. It goes
+            // straight into the receive ring, after any frame cut off by
+            // the last receive.
+            rbfrSpace = ringSpace(&rbfrRing, &rbfrSpaceLen);
+            rlen = recvfrom(clientSock, rbfrSpace, rbfrSpaceLen, 0, NULL,
                     NULL);
 
             // Check to see if socket is still alive
             if (rlen > 0) 
             {
+                // The first message read ends the connection setup
+                if (setupPending)
+                {
+                    setupTicks = ReadCoreTimer() - acceptedAt;
+                    setupPending = 0;
+                }
+
+                ringCommit(&rbfrRing, rlen);
+
+                // Between tests only commands are expected. Whatever 
+                // follows a command, or is none, is dropped.
+                if (testStarted == 0)
+                {
+                    command = ringCommand(&rbfrRing);
+                    if (command != 0) ringReset(&rbfrRing);
+                }
+
                 // Check to see if message begins with
                 // '0271' signifying message is a global reset
                 // We use this as a signal to start the lab
                 // experiment. 
-                if ((testStarted == 0) && (rbfrRaw[0] == 02) && 
-                        (rbfrRaw[1] == 71))
+                if ((testStarted == 0) && (command == 71))
                 {                        
                     // Reset Sequence Number
                     tbfrSeqTracker = 0;
+                    rbfrSeqTracker = 0;
+                    rbfrAckPending = 0;
+                    rbfrAckDue = 0;
+                    timerStop(&wheel, &rbfrAckTimer);
+                    rbfrNakSent = 0;
 
                     // Reset total msg sent counter
                     msgSent = 0;
-                    endMsg=0;
+                    tbfrRecover = 0;
                     testStarted = 1;
                     
-                    // reset delay counts
-                    transDelayCount = 0;
-                    ackDelayCount = 0;
+                    // Drop frames still awaiting ACKs from an earlier run
+                    txReset(&tbfrWindow);
 
-                    // Check for seq rollover
-                    if(tbfrSeqTracker > LENM)
-                    {
-                        tbfrSeqTracker = 0;
-                    }
-
-                    // Populate sequence number
-                    tbfrData[msgSent].sequence = 
-                        tbfrSeqTracker++;
-
-                    // Copy tbfrData over to tbfr and keep track
-                    // of how much msg has been sent thus far
-                    tbfr = tbfrData[msgSent++];
-
-                    mPORTDClearBits(BIT_0);
+                    // The window is empty, so the first frames go out
+                    // below on this pass
+                }
+                // Check to see if message begins with
+                // '0266' signifying a frame rate benchmark request. The
+                // results are sent back as text.
+                else if ((testStarted == 0) && (command == 66))
+                {
                     mPORTDSetBits(BIT_2);   // LED3=1
-                    send(clientSock, &tbfr, sizeof(myDataPacket), 0);
+                    tlen = frameRateBenchmark(report);
+                    tlen += timerBenchmark(report+tlen);
+                    tlen += sprintf(report+tlen, "setup-us\r\n%u\r\n",
+                            setupTicks/(TICKSPERMSEC/1000));
+                    send(clientSock, report, tlen, 0);
                     mPORTDClearBits(BIT_2); // LED3=0
-                    DelayMsec(100);
-
-                    // Mark frame as sent by queuing up sequence in ACK 
-                    // awaiting response.
-                    Enqueue(tbfrAckQueue, tbfr.sequence);
                 }
-                // If not prefixed we say client is sending back 
-                // we need to parse to determine if message is an ACK or`
-                // the received data
+                // If not prefixed we say client is sending back frames.
+                // Data and ACKs may be mixed in one buffer, each frame
+                // header says which it is.
                 else if (testStarted==1)
                 {
-                    // Check what time of message was revived based on its
-                    // size
-                    // Check if received is an myDataPacket
-                    if (rlen%sizeof(myDataPacket)==0)
-                    {                       
-                        // Convert the received data into a dataPacket 
-                        // struct
-                        rbfrData = (myDataPacket *) rbfrRaw;
-
-                        // Store sequence in receive Queue if it is 
-                        // next in Queue
-                        
-                        // Check for start of tranmission OR
-                        // Check for sequential sequence number OR
-                        // Check for sequential sequence rollover
-                        if(rbfrSeqTracker == (rbfrData->sequence))
+                    // Parse every whole frame in the ring where it lies. A
+                    // frame cut off at the end stays for the next receive.
+                    while ((frame = ringFrame(&rbfrRing, &flen)) != NULL)
+                    {
+                        ringConsume(&rbfrRing, flen);
+
+                        if (frameType(frame) == FRAMEDATA)
                         {
-                            rbfrSeqTracker++;
-                            // Check for seq rollover
-                            if(rbfrSeqTracker > LENM)
+                            // Count the frame if it is next in order. Any
+                            // frame, in order or not, makes sure an ACK
+                            // goes out within ACKDELAYMSEC.
+                            if(rbfrSeqTracker == frameSequence(frame))
                             {
-                                rbfrSeqTracker = 0;
+                                rbfrSeqTracker = seqAdd(rbfrSeqTracker, 1);
+                                rbfrAckPending++;
+                                rbfrNakSent = 0;
+                            }
+                            // A frame past the one we wait for means that
+                            // one was lost. NAK (0x15) it right away, 
+                            // once, which also ACKs every frame before it.
+                            // An old duplicate only needs the ACK again.
+                            else if (!rbfrNakSent && seqLess(rbfrSeqTracker,
+                                    frameSequence(frame)))
+                            {
+                                sendAck(clientSock, &tbfrBatch,
+                                    rbfrSeqTracker, 0x15);
+                                rbfrNakSent = 1;
+                                rbfrAckPending = 0;
+                                rbfrAckDue = 0;
+                                timerStop(&wheel, &rbfrAckTimer);
+                                continue;
+                            }
+                            if (!rbfrAckDue)
+                            {
+                                rbfrAckDue = 1;
+                                timerStart(&wheel, &rbfrAckTimer, 
+                                    ACKDELAYMSEC*TICKSPERMSEC);
                             }
-                            Enqueue(rbfrDataQueue, rbfrData->sequence);
                         }
-
-                        // If FRAMEDELAY Equal to size
-                        if(rbfrDataQueue->size == FRAMEDELAY || endMsg == 1)
+                        else
                         {
-                            // Send ACK for Random number of packets
-                            if (randMToN(0.0,1.0) >= PROBACKERR)
+                            // An ACK covers the frame with its sequence
+                            // number and every frame before it, a NAK
+                            // (0x15) every frame before it. One for a
+                            // frame not outstanding changes nothing.
+                            if (frameAckChar(frame) == 0x06)
                             {
-                                rbfrAck.sequence = front(rbfrDataQueue);
-                                rbfrAck.ackChar = 0x06;
-                                mPORTDClearBits(BIT_0);
-                                mPORTDSetBits(BIT_2);   // LED3=1
-                                send(clientSock, &rbfrAck, 
-                                    sizeof(myACK), 0);
-                                mPORTDClearBits(BIT_2); // LED3=0
-                                DelayMsec(100);
+                                acked = findInWindow(&tbfrWindow, 
+                                    frameSequence(frame));
                             }
+                            else if (frameAckChar(frame) == 0x15)
+                            {
+                                acked = findInWindow(&tbfrWindow, 
+                                    seqAdd(frameSequence(frame), -1));
+                            }
+                            else continue;
 
-                            // Remove the sent ACK from receive Q
-                            Dequeue(rbfrDataQueue);
-                        }
-                    }
-                    // Check if received is an myACK
-                    else if (rlen%sizeof(myACK)==0)
-                    {
-                        // Convert the received data into a myAck struct
-                        tbfrAck = (myACK *) rbfrRaw;
-                        
-                        // Check if ACK
-                        if(tbfrAck->ackChar == 0x06)
-                        {
-                            if(front(tbfrAckQueue) == (tbfrAck->sequence))
+                            if (acked >= 0)
                             {
-                                Dequeue(tbfrAckQueue);
-                                ackDelayCount = 0;
+                                // Sample the RTT unless the frame was 
+                                // resent, since then the ACK may belong to
+                                // either send (Karn's rule)
+                                desc = txAt(&tbfrWindow, acked);
+                                if (!desc->resent)
+                                {
+                                    rtoSample(&rtt, 
+                                        ReadCoreTimer() - desc->sentAt);
+                                }
+                                else rtoRestore(&rtt);
+                                txPop(&tbfrWindow, acked+1);
+                                timerStart(&wheel, &ackTimer, rtt.rto);
                             }
-                            // Check if end of expirment
-                            if (tbfrAckQueue->size == 0 && endMsg == 1)
+
+                            // Fast retransmit. Go back to the NAKed frame
+                            // now instead of waiting for its timer. The
+                            // timeout is not backed off as the link still
+                            // delivers.
+                            if (frameAckChar(frame) == 0x15 && 
+                                findInWindow(&tbfrWindow, 
+                                    frameSequence(frame)) == 0 &&
+                                msgSent - txCount(&tbfrWindow) >= tbfrRecover)
                             {
-                                testStarted = 0;
+                                tbfrRecover = msgSent;
+                                txRewind(&tbfrWindow);
+                                timerStart(&wheel, &ackTimer, rtt.rto);
                             }
                         }
-                    }                    
+                    }
+
+                    // A bad header means the framing is lost, so nothing
+                    // held can be trusted
+                    if (flen < 0) ringReset(&rbfrRing);
+
+                    // One ACK covers up to FRAMEDELAY frames
+                    if (rbfrAckPending >= FRAMEDELAY)
+                    {
+                        sendAck(clientSock, &tbfrBatch,
+                            seqAdd(rbfrSeqTracker, -1), 0x06);
+                        rbfrAckPending = 0;
+                        rbfrAckDue = 0;
+                        timerStop(&wheel, &rbfrAckTimer);
+                    }
+
+                    // Check if end of expirment, every frame sent and ACKed
+                    if (txCount(&tbfrWindow) == 0 && msgSent == MSGLEN)
+                    {
+                        testStarted = 0;
+                        ringReset(&rbfrRing);
+                    }
                 }
             }
             else if (rlen < 0) 
@@ -342,110 +710,81 @@ int main()
                 //
                 closesocket(clientSock);
                 clientSock = SOCKET_ERROR;
+                tbfrBatch.len = 0;
             }
 
-            // If rlen is zero length we increment delay count
-            else if (testStarted == 1)
+            // Send the ACK the receiver held back once its timer ran out
+            if (clientSock != INVALID_SOCKET && rbfrAckDue && 
+                    !timerPending(&rbfrAckTimer))
             {
-                DelayMsec(10);
-                ackDelayCount++;
-                transDelayCount++;
-
-                // Check if time to send another DataPacket and if 
-                // we have more msg to send.
-                if (transDelayCount*10 > TRANSMISSIONDELAY && msgSent < MSGLEN)
-                {
-                    // reset delay counts
-                    transDelayCount = 0;
-
-                    // Check for seq rollover
-                    if(tbfrSeqTracker > LENM)
-                    {
-                        tbfrSeqTracker = 0;
-                    }
-
-                    // Populate sequence number
-                    tbfrData[msgSent].sequence = 
-                        tbfrSeqTracker++;
+                sendAck(clientSock, &tbfrBatch, seqAdd(rbfrSeqTracker, -1),
+                    0x06);
+                rbfrAckPending = 0;
+                rbfrAckDue = 0;
+            }
 
-                    // Copy tbfrData over to tbfr and keep track
-                    // of how much msg has been sent thus far
-                    tbfr = tbfrData[msgSent++];
+            // Check for ACK timeout
+            if (clientSock != INVALID_SOCKET && testStarted == 1 && 
+                    txCount(&tbfrWindow) > 0 && !timerPending(&ackTimer))
+            {
+                // Every unACKed frame goes again, so none of them can
+                // give an RTT sample. Back off until one that can.
+                rtoBackoff(&rtt);
+                timerStart(&wheel, &ackTimer, rtt.rto);
+
+                // Go back to the oldest unACKed frame. The window is sent
+                // again from there below.
+                tbfrRecover = msgSent;
+                txRewind(&tbfrWindow);
+            }
 
-                    // Send FRAME with random error change
-                    if (randMToN(0.0,1.0) >= PROBSENTERR)
+            // Send every frame a go back left to resend, then every new
+            // one the window has room for. Only a TRANSMISSIONDELAY above
+            // zero holds frames further apart.
+            while (clientSock != INVALID_SOCKET && testStarted == 1 && 
+                    (tbfrWindow.next != tbfrWindow.tail || 
+                     (msgSent < MSGLEN && txCount(&tbfrWindow) < LENM)) &&
+                    SENDDUE(lastSentAt))
+            {
+                // A new frame gets the next sequence number and joins the
+                // window where it lies in tbfrData
+                if (tbfrWindow.next == tbfrWindow.tail)
+                {
+                    if (txPush(&tbfrWindow, &tbfrData[msgSent]) == NULL) 
                     {
-                        mPORTDClearBits(BIT_0);
-                        mPORTDSetBits(BIT_2);   // LED3=1
-                        send(clientSock, &tbfr, sizeof(myDataPacket), 0);
-                        mPORTDClearBits(BIT_2); // LED3=0
-                        DelayMsec(100);
+                        break;
                     }
+                    tbfrData[msgSent++].sequence = tbfrSeqTracker;
+                    tbfrSeqTracker = seqAdd(tbfrSeqTracker, 1);
 
-                    // Mark frame as sent by queuing up sequence in ACK 
-                    // awaiting response.
-                    Enqueue(tbfrAckQueue, tbfr.sequence);
-                    
-                    // Check to see if we hit FRAMEDELAY Limit. If so we
-                    // start the ackDelay Count (or in other words don't reset)
-                    if (tbfrAckQueue->size <= FRAMEDELAY)
+                    // Start the ACK timer if no other frame is outstanding
+                    if (txCount(&tbfrWindow) == 1)
                     {
-                        ackDelayCount = 0;
+                        timerStart(&wheel, &ackTimer, rtt.rto);
                     }
-                    
-                    // Check to see if end of tranmission
-                    if (msgSent == MSGLEN) endMsg = 1;
                 }
-                // Check for ACK timeout
-                else if (ackDelayCount*10 > ACKTIMEOUT)
-                {
-                    // reset delay counts
-                    transDelayCount = 0;
-                    ackDelayCount = 0;
-
-                    // Reset msgSent tracker
-                    msgSent = msgSent - tbfrAckQueue->size;
-
-                    // Clear sent queue
-                    clearQueue(tbfrAckQueue);
-
-                    // Copy tbfrData over to tbfr and keep track
-                    // of how much msg has been sent thus far
-                    tbfr = tbfrData[msgSent++];
-                    
-                    // Reset seq tracker
-                    tbfrSeqTracker = tbfr.sequence+1;
-                    
-                    // Send FRAME with random error change
-                    if (randMToN(0.0,1.0) >= PROBSENTERR)
-                    {
-                        mPORTDClearBits(BIT_0);
-                        mPORTDSetBits(BIT_2);   // LED3=1
-                        send(clientSock, &tbfr, sizeof(myDataPacket), 0);
-                        mPORTDClearBits(BIT_2); // LED3=0
-                        DelayMsec(100);
-                    }
+                desc = txNext(&tbfrWindow);
+                lastSentAt = ReadCoreTimer();
+                desc->sentAt = lastSentAt;
 
-                    // Mark frame as sent by queuing up sequence in ACK 
-                    // awaiting response.
-                    Enqueue(tbfrAckQueue, tbfr.sequence);
+                // Send FRAME with random error change, straight from its
+                // place in tbfrData
+                if (randMToN(0.0,1.0) >= PROBSENTERR)
+                {
+                    batchAdd(clientSock, &tbfrBatch, desc->packet, 
+                        sizeof(myDataPacket));
                 }
             }
+
+            // Everything this pass produced goes out in one send
+            if (clientSock != INVALID_SOCKET)
+            {
+                batchFlush(clientSock, &tbfrBatch);
+            }
         }   
     }
 }
 
-// Function : DelayMsec( )
-// 
-// Delays the program by specified millisecond passed
-void DelayMsec(unsigned int msec) 
-{
-    unsigned int tWait, tStart;
-    tWait = (SYS_FREQ / 2000) * msec;
-    tStart = ReadCoreTimer();
-    while ((ReadCoreTimer() - tStart) < tWait);
-}
-
 void generateAlphabet(myDataPacket *tbfrData, int tlen) 
 {
     // Loop tracker
@@ -453,6 +792,8 @@ void generateAlphabet(myDataPacket *tbfrData, int tlen)
 
     for(i=0; i < tlen; i++)
     {
+        tbfrData[i].type = FRAMEDATA;
+        tbfrData[i].length = DATAPAYLOAD;
         for(j=0; j < DATALEN; j++)
         {
             // We start populating data with ascii A
@@ -466,108 +807,763 @@ double randMToN(double M, double N)
     return M + (rand() / ( RAND_MAX / (N-M) ) ) ;  
 }
 
-// Queue Data Structure
-// Source From:
-// http://www.thelearningpoint.net/computer-science/data-structures-queues--with-c-program-source-code
+// Sequence number n after this one, n may be negative
+uint32_t seqAdd(uint32_t sequence, int n)
+{
+    return (sequence + (uint32_t)n) & SEQMASK;
+}
+
+// How far sequence number to is after from, mod 2^SEQBITS
+uint32_t seqOffset(uint32_t from, uint32_t to)
+{
+    return (to - from) & SEQMASK;
+}
+
+// Nonzero if a comes before b. Numbers more than half the space apart
+// count as wrapped (RFC 1982).
+int seqLess(uint32_t a, uint32_t b)
+{
+    uint32_t offset = seqOffset(a, b);
+
+    return offset != 0 && offset <= SEQMASK/2;
+}
 
-// crateQueue function takes argument the maximum number of elements the
-// Queue can hold, creates
-// a Queue according to it and returns a pointer to the Queue.
-Queue * createQueue(int maxElements)
+// Adds an ACK (0x06) or NAK (0x15) with this sequence number to batch.
+// PROBACKERR of them are dropped instead.
+void sendAck(SOCKET sock, txBatch *batch, uint32_t sequence, char ackChar)
 {
-    // Create a Queue
-    Queue *Q;
-    Q = (Queue *)malloc(sizeof(Queue));
-    // Initialize its properties
-    Q->elements = (int *)malloc(sizeof(int)*maxElements);
-    Q->size = 0;
-    Q->capacity = maxElements;
-    Q->front = 0;
-    Q->rear = -1;
-    /* Return the pointer */
-    return Q;
+    myACK ack;
+
+    if (randMToN(0.0,1.0) < PROBACKERR) return;
+    ack.type = FRAMEACK;
+    ack.length = ACKPAYLOAD;
+    ack.sequence = sequence;
+    ack.ackChar = ackChar;
+    batchAdd(sock, batch, &ack, sizeof(myACK));
 }
 
-void Dequeue(Queue *Q)
+// Length of the whole frame at the start of buf, which holds len bytes.
+// Returns 0 while the frame is not all in buf yet and -1 for a header no
+// frame has.
+int frameLength(const char *buf, int len)
 {
-    // If Queue size is zero then it is empty. So we cannot pop
-    if(Q->size==0)
+    uint8_t type, length;
+
+    if (len < (int)sizeof(frameHeader)) return 0;
+    type = frameType(buf);
+    length = buf[offsetof(frameHeader, length)];
+    if (!(type == FRAMEDATA && length == DATAPAYLOAD) &&
+        !(type == FRAMEACK && length == ACKPAYLOAD))
     {
-        printf("Queue is Empty\n");
-        return;
+        return -1;
+    }
+    if (len < (int)sizeof(frameHeader) + length) return 0;
+    return sizeof(frameHeader) + length;
+}
+
+// Fields of a frame viewed in the receive ring. A frame can start at any
+// byte, so fields wider than a byte are copied out rather than loaded
+// through a cast pointer to the packed struct.
+uint8_t frameType(const char *frame)
+{
+    return frame[offsetof(frameHeader, type)];
+}
+
+uint32_t frameSequence(const char *frame)
+{
+    wireSeq sequence;
+
+    memcpy(&sequence, frame + offsetof(frameHeader, sequence),
+        sizeof(wireSeq));
+    return sequence;
+}
+
+char frameAckChar(const char *frame)
+{
+    return frame[offsetof(myACK, ackChar)];
+}
+
+void ringReset(rxRing *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Free space at tail that recvfrom can write in one piece. Sets len to its
+// size.
+char *ringSpace(rxRing *ring, int *len)
+{
+    unsigned int at = ring->tail % RXRING;
+    unsigned int space = RXRING - (ring->tail - ring->head);
+
+    *len = RXRING - at < space ? RXRING - at : space;
+    return ring->bytes + at;
+}
+
+// Adds the len bytes recvfrom wrote at ringSpace to the ring
+void ringCommit(rxRing *ring, int len)
+{
+    ring->tail += len;
+}
+
+// Byte after the '02' of an unframed command at head. Returns 0 while the
+// command is not all in yet and -1 if head holds none.
+int ringCommand(rxRing *ring)
+{
+    unsigned char command;
+
+    if (ring->tail - ring->head < 1) return 0;
+    if (ring->bytes[ring->head % RXRING] != 02) return -1;
+    if (ring->tail - ring->head < 2) return 0;
+    command = ring->bytes[(ring->head + 1) % RXRING];
+    return command != 0 ? command : -1;
+}
+
+// View of the whole frame at head, NULL while it is not all in yet. Sets
+// len to its length, or to -1 when head holds no valid frame. The part of
+// a frame that wrapped to the start of bytes is copied after the end, the
+// only copy a frame ever needs.
+char *ringFrame(rxRing *ring, int *len)
+{
+    unsigned int at = ring->head % RXRING;
+    unsigned int n = ring->tail - ring->head;
+
+    if (n > MAXFRAMELEN) n = MAXFRAMELEN;
+    if (at + n > RXRING) memcpy(ring->bytes + RXRING, ring->bytes, 
+        at + n - RXRING);
+    *len = frameLength(ring->bytes + at, n);
+    return *len > 0 ? ring->bytes + at : NULL;
+}
+
+// Frees the len bytes at head once their frame is handled
+void ringConsume(rxRing *ring, int len)
+{
+    ring->head += len;
+}
+
+// Appends a frame to batch. A batch without room for it is sent first.
+void batchAdd(SOCKET sock, txBatch *batch, const void *frame, int len)
+{
+    if (batch->len + len > TXLEN) batchFlush(sock, batch);
+    memcpy(batch->bytes + batch->len, frame, len);
+    batch->len += len;
+}
+
+// Sends every frame in batch with one send and empties it
+void batchFlush(SOCKET sock, txBatch *batch)
+{
+    if (batch->len == 0) return;
+    mPORTDClearBits(BIT_0);
+    mPORTDSetBits(BIT_2);   // LED3=1
+    send(sock, batch->bytes, batch->len, 0);
+    mPORTDClearBits(BIT_2); // LED3=0
+    batch->len = 0;
+}
+
+void rtoReset(rttEstimator *est)
+{
+    est->sampled = 0;
+    est->rto = ACKTIMEOUT*TICKSPERMSEC;
+}
+
+// Folds a round trip time in ticks into the estimate as in RFC 6298:
+// srtt moves 1/8 and rttvar 1/4 of the way to the new sample. A sample
+// also drops any backoff.
+void rtoSample(rttEstimator *est, unsigned int ticks)
+{
+    unsigned int rtoMax = RTOMAXMSEC*TICKSPERMSEC;
+    unsigned int delta;
+
+    if (ticks > rtoMax) ticks = rtoMax;
+    if (!est->sampled)
+    {
+        est->srtt = ticks;
+        est->rttvar = ticks/2;
+        est->sampled = 1;
     }
-    // Removing an element is equivalent to incrementing index of front 
-    // by one
     else
     {
-            Q->size--;
-            Q->front++;
-            // As we fill elements in circular fashion
-            if(Q->front==Q->capacity)
-            {
-                Q->front=0;
-            }
+        delta = ticks > est->srtt ? ticks - est->srtt : est->srtt - ticks;
+        est->rttvar = est->rttvar - est->rttvar/4 + delta/4;
+        est->srtt = est->srtt - est->srtt/8 + ticks/8;
+    }
+    rtoRestore(est);
+}
+
+// Drops any backoff. The timeout is srtt + 4*rttvar kept within
+// RTOMINMSEC and RTOMAXMSEC, or ACKTIMEOUT before the first sample. A
+// timeout resends the whole window, so ACKs of resent frames restore the
+// timeout as well: waiting for a frame sent once would keep the backoff
+// growing while every window loses a frame.
+void rtoRestore(rttEstimator *est)
+{
+    unsigned int rtoMax = RTOMAXMSEC*TICKSPERMSEC;
+
+    if (!est->sampled)
+    {
+        est->rto = ACKTIMEOUT*TICKSPERMSEC;
+        return;
     }
-    return;
+    if (est->rttvar > (rtoMax - est->srtt)/4) est->rto = rtoMax;
+    else est->rto = est->srtt + 4*est->rttvar;
+    if (est->rto < RTOMINMSEC*TICKSPERMSEC)
+    {
+        est->rto = RTOMINMSEC*TICKSPERMSEC;
+    }
+}
+
+// Doubles the timeout after a retransmission, up to RTOMAXMSEC
+void rtoBackoff(rttEstimator *est)
+{
+    unsigned int rtoMax = RTOMAXMSEC*TICKSPERMSEC;
+
+    if (est->rto > rtoMax/2) est->rto = rtoMax;
+    else est->rto *= 2;
 }
 
-int front(Queue *Q)
+// Empties the wheel and starts it at the core timer value now. Timers
+// still linked into it must not be used again without timerInit.
+void wheelReset(timerWheel *wheel)
 {
-    if(Q->size==0)
+    memset(wheel->slot, 0, sizeof(wheel->slot));
+    wheel->now = 0;
+    wheel->due = ReadCoreTimer();
+    wheel->pending = 0;
+}
+
+// Links timer into the slot its expiry falls in, seen from now. Timers
+// beyond the reach of the wheel are pulled in to its last tick.
+void wheelInsert(timerWheel *wheel, wheelTimer *timer)
+{
+    wheelTimer **slot;
+    unsigned int delta = timer->expires - wheel->now;
+    int level = 0;
+
+    if (delta >> (WHEELBITS*WHEELLEVELS) != 0)
     {
-        printf("Queue is Empty\n");
-        exit(0);
+        delta = (1u << (WHEELBITS*WHEELLEVELS)) - 1;
+        timer->expires = wheel->now + delta;
     }
-    // Return the element which is at the front
-    return Q->elements[Q->front];
+    while (delta >> (WHEELBITS*(level+1)) != 0) level++;
+
+    slot = &wheel->slot[level][(timer->expires >> (WHEELBITS*level)) & 
+        WHEELMASK];
+    timer->next = *slot;
+    if (*slot != NULL) (*slot)->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
 }
 
-int rear(Queue *Q)
+// Runs the wheel up to core timer tick core. Each wheel tick due by then
+// first moves the timers of every higher level slot it starts down a
+// level, then runs the timers of its level 0 slot, which all expire at
+// that tick. Handlers may start and stop timers. Returns the number of
+// timers that ran out.
+int wheelService(timerWheel *wheel, unsigned int core)
 {
-    if(Q->size==0)
+    wheelTimer *due, *timer;
+    unsigned int skip;
+    int level, n = 0;
+
+    while ((int)(core - wheel->due) >= 0)
     {
-        printf("Queue is Empty\n");
-        exit(0);
+        // With no timer running every tick up to core is empty
+        if (wheel->pending == 0)
+        {
+            skip = (core - wheel->due)/WHEELTICK + 1;
+            wheel->now += skip;
+            wheel->due += skip*WHEELTICK;
+            break;
+        }
+
+        for(level=1; level < WHEELLEVELS && ((wheel->now >> 
+                (WHEELBITS*(level-1))) & WHEELMASK) == 0; level++)
+        {
+            due = wheel->slot[level][(wheel->now >> (WHEELBITS*level)) & 
+                WHEELMASK];
+            wheel->slot[level][(wheel->now >> (WHEELBITS*level)) & 
+                WHEELMASK] = NULL;
+            while ((timer = due) != NULL)
+            {
+                due = timer->next;
+                wheelInsert(wheel, timer);
+            }
+        }
+
+        // Take the slot off the wheel before running it, so a timer its
+        // handlers start lands in the future
+        due = wheel->slot[0][wheel->now & WHEELMASK];
+        wheel->slot[0][wheel->now & WHEELMASK] = NULL;
+        if (due != NULL) due->pprev = &due;
+        wheel->now++;
+        wheel->due += WHEELTICK;
+        while ((timer = due) != NULL)
+        {
+            timerStop(wheel, timer);
+            if (timer->handler != NULL) timer->handler(timer);
+            n++;
+        }
     }
-    // Return the element which is at the front
-    return Q->elements[Q->rear];
+    return n;
 }
 
-void Enqueue(Queue *Q, int element)
+// Sets timer up, not running, to call handler with it when it runs out.
+// A timer with no handler just stops running, which timerPending shows.
+void timerInit(wheelTimer *timer, void (*handler)(wheelTimer *timer), 
+        void *arg)
 {
-    // If the Queue is full, we cannot push an element into it as 
-    // there is no space for it.
-    if(Q->size == Q->capacity)
+    timer->pprev = NULL;
+    timer->handler = handler;
+    timer->arg = arg;
+}
+
+// Starts timer, or restarts it if it runs, so it runs out the given number
+// of core timer ticks from now. It never runs out early. It runs out late
+// by less than a wheel tick plus however long the main loop takes to
+// call wheelService.
+void timerStart(timerWheel *wheel, wheelTimer *timer, unsigned int ticks)
+{
+    long long ahead;
+
+    timerStop(wheel, timer);
+
+    // Wheel ticks from now to the deadline, rounded up. The wheel may be
+    // behind the core timer if the loop was busy.
+    ahead = (long long)ticks + (int)(ReadCoreTimer() - wheel->due);
+    timer->expires = wheel->now;
+    if (ahead > 0) timer->expires += (ahead + WHEELTICK - 1)/WHEELTICK;
+    wheelInsert(wheel, timer);
+    wheel->pending++;
+}
+
+// Stops timer if it runs
+void timerStop(timerWheel *wheel, wheelTimer *timer)
+{
+    if (!timerPending(timer)) return;
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) timer->next->pprev = timer->pprev;
+    timer->pprev = NULL;
+    wheel->pending--;
+}
+
+int timerPending(wheelTimer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+void txReset(txRing *ring)
+{
+    ring->head = 0;
+    ring->next = 0;
+    ring->tail = 0;
+}
+
+// Number of unACKed frames in the window
+int txCount(txRing *ring)
+{
+    return ring->tail - ring->head;
+}
+
+// Adds the frame at packet to the end of the window. Returns its 
+// descriptor, or NULL when the ring is full.
+txDesc *txPush(txRing *ring, myDataPacket *packet)
+{
+    txDesc *desc;
+
+    if (txCount(ring) == TXRING) return NULL;
+    desc = &ring->desc[ring->tail++ & TXRINGMASK];
+    desc->packet = packet;
+    desc->sentAt = 0;
+    desc->resent = 0;
+    return desc;
+}
+
+// Descriptor i frames from the oldest unACKed one, NULL past the end
+txDesc *txAt(txRing *ring, int i)
+{
+    if (i < 0 || i >= txCount(ring)) return NULL;
+    return &ring->desc[(ring->head + i) & TXRINGMASK];
+}
+
+// Descriptor of the next frame to send, NULL when all went out
+txDesc *txNext(txRing *ring)
+{
+    if (ring->next == ring->tail) return NULL;
+    return &ring->desc[ring->next++ & TXRINGMASK];
+}
+
+// Drops the n oldest frames from the window once they are ACKed
+void txPop(txRing *ring, int n)
+{
+    if (n > txCount(ring)) n = txCount(ring);
+    ring->head += n;
+    if ((int)(ring->next - ring->head) < 0) ring->next = ring->head;
+}
+
+// Goes back to the oldest unACKed frame so the whole window is sent
+// again. Every frame in it is marked as resent.
+void txRewind(txRing *ring)
+{
+    unsigned int i;
+
+    for(i=ring->head; i != ring->tail; i++)
     {
-        printf("Queue is Full\n");
+        ring->desc[i & TXRINGMASK].resent = 1;
     }
-    else
+    ring->next = ring->head;
+}
+
+// Position of the frame with this sequence number counted from the oldest
+// unACKed one, -1 if it is not outstanding. The window holds consecutive
+// sequence numbers, so this is the distance from the oldest.
+int findInWindow(txRing *tbfrWindow, uint32_t sequence)
+{
+    uint32_t offset;
+
+    if (txCount(tbfrWindow) == 0) return -1;
+    offset = seqOffset(txAt(tbfrWindow, 0)->packet->sequence, sequence);
+    return offset < (uint32_t)txCount(tbfrWindow) ? (int)offset : -1;
+}
+
+// Sends an ACK for frame, or with nak set a NAK, at time t. ackLossPct of
+// them are lost.
+void simAckSend(simAcks *acks, int t, int frame, int nak, int ackLossPct)
+{
+    acks->sent++;
+    if (rand() % 100 < ackLossPct || acks->tail - acks->head == SIMACKS) 
     {
-            Q->size++;
-            Q->rear = Q->rear + 1;
-            // As we fill the queue in circular fashion
-            if(Q->rear == Q->capacity)
+        return;
+    }
+    acks->at[acks->tail % SIMACKS] = t + SIMRTTMS/2;
+    acks->frame[acks->tail % SIMACKS] = frame;
+    acks->nak[acks->tail % SIMACKS] = nak;
+    acks->tail++;
+}
+
+// Simulates SIMFRAMES frames of the go-back-N sender with at least gapMsec
+// between frames at a round trip of SIMRTTMS. Time is kept in msec.
+//
+// The receiver takes frames only in order. With coalesce zero it ACKs each
+// frame it takes or already has and the sender only takes the ACK of its
+// oldest frame, as with the old receiver. Otherwise it sends a cumulative
+// ACK every coalesce frames and at most ACKDELAYMSEC after any frame, and
+// with nak set it NAKs the frame it waits for on the first other frame.
+//
+// The timer covers the oldest unACKed frame and sends the window again
+// from there when it runs out. A NAK does the same right away, unless it
+// names a frame sent before the last go back.
+//
+// Fills in the frame rate, the ACKs and NAKs sent per 100 frames, and the
+// mean time from the first loss of a frame until it is ACKed.
+void gbnSimulate(gbnSim *sim)
+{
+    simAcks acks;
+    uint8_t resent[LENM];
+    int lostAt[LENM];   // -1 if the frame was never lost
+    int base = 0, next = 0, sentMax = 0, recover = 0, expected = 0;
+    int pending = 0, ackDue = 0, ackDueAt = 0, nakSent = 0;
+    int t = 0, sendAt = 0, deadline = 0, tNext, arrive, m, nak;
+    int losses = 0, recoveryTotal = 0;
+    rttEstimator est;
+
+    rtoReset(&est);
+    acks.head = 0;
+    acks.tail = 0;
+    acks.sent = 0;
+    while (base < SIMFRAMES)
+    {
+        // Send the next frame if the window and the gap allow. The
+        // receiver handles it right away, half a round trip ahead.
+        if (next < SIMFRAMES && next < base + LENM && t >= sendAt)
+        {
+            if (next == sentMax)
             {
-                Q->rear = 0;
+                resent[next % LENM] = 0;
+                lostAt[next % LENM] = -1;
+                sentMax++;
             }
-            // Insert the element in its rear side
-            Q->elements[Q->rear] = element;
+            if (rand() % 100 < sim->lossPct)
+            {
+                if (lostAt[next % LENM] < 0) lostAt[next % LENM] = t;
+            }
+            else
+            {
+                arrive = t + SIMRTTMS/2;
+                if (ackDue && ackDueAt <= arrive)
+                {
+                    simAckSend(&acks, ackDueAt, expected-1, 0, 
+                            sim->ackLossPct);
+                    pending = 0;
+                    ackDue = 0;
+                }
+                if (next == expected)
+                {
+                    expected++;
+                    pending++;
+                    nakSent = 0;
+                }
+                else if (sim->coalesce > 0 && sim->nak && !nakSent)
+                {
+                    simAckSend(&acks, arrive, expected, 1, sim->ackLossPct);
+                    nakSent = 1;
+                    pending = 0;
+                    ackDue = 0;
+                }
+                if (sim->coalesce == 0 && next < expected)
+                {
+                    simAckSend(&acks, arrive, next, 0, sim->ackLossPct);
+                }
+                if (sim->coalesce > 0 && !ackDue && !nakSent && expected > 0)
+                {
+                    ackDue = 1;
+                    ackDueAt = arrive + ACKDELAYMSEC;
+                }
+                if (sim->coalesce > 0 && pending >= sim->coalesce)
+                {
+                    simAckSend(&acks, arrive, expected-1, 0, 
+                            sim->ackLossPct);
+                    pending = 0;
+                    ackDue = 0;
+                }
+            }
+            if (base == next) deadline = t + est.rto/TICKSPERMSEC;
+            next++;
+            sendAt = t + sim->gapMsec;
+            continue;
+        }
+
+        // Move on to whatever happens first
+        tNext = ackDue ? ackDueAt : -1;
+        if (acks.head < acks.tail && 
+                (tNext < 0 || acks.at[acks.head % SIMACKS] < tNext))
+        {
+            tNext = acks.at[acks.head % SIMACKS];
+        }
+        if (base < next && (tNext < 0 || deadline < tNext))
+        {
+            tNext = deadline;
+        }
+        if (next < SIMFRAMES && next < base + LENM && 
+                (tNext < 0 || sendAt < tNext))
+        {
+            tNext = sendAt;
+        }
+        if (tNext > t) t = tNext;
+
+        if (ackDue && ackDueAt <= t)
+        {
+            simAckSend(&acks, ackDueAt, expected-1, 0, sim->ackLossPct);
+            pending = 0;
+            ackDue = 0;
+        }
+        else if (acks.head < acks.tail && acks.at[acks.head % SIMACKS] <= t)
+        {
+            m = acks.frame[acks.head % SIMACKS];
+            nak = acks.nak[acks.head % SIMACKS];
+            acks.head++;
+            if (nak) m--;
+            if (m >= base && m < next && (sim->coalesce > 0 || m == base))
+            {
+                if (!resent[m % LENM]) rtoSample(&est, SIMRTTMS*TICKSPERMSEC);
+                else rtoRestore(&est);
+                for(; base <= m; base++)
+                {
+                    if (lostAt[base % LENM] >= 0)
+                    {
+                        recoveryTotal += t - lostAt[base % LENM];
+                        losses++;
+                    }
+                }
+                deadline = t + est.rto/TICKSPERMSEC;
+            }
+            if (nak && m+1 == base && base < next && base >= recover)
+            {
+                recover = sentMax;
+                for(m=base; m < next; m++) resent[m % LENM] = 1;
+                next = base;
+                sendAt = t;
+                deadline = t + est.rto/TICKSPERMSEC;
+            }
+        }
+        else if (base < next && t >= deadline)
+        {
+            rtoBackoff(&est);
+            recover = sentMax;
+            for(m=base; m < next; m++) resent[m % LENM] = 1;
+            next = base;
+            sendAt = t;
+            deadline = t + est.rto/TICKSPERMSEC;
+        }
     }
-    return;
+    sim->framesPerSec = (int)((long long)SIMFRAMES*1000 / t);
+    sim->acksPer100 = acks.sent*100/SIMFRAMES;
+    sim->recoveryMsec = losses ? recoveryTotal/losses : 0;
 }
 
-void clearQueue(Queue *Q)
+// Writes the simulated frame rate of the old paced sender and of the
+// window limited one at each frame loss rate into report. Then the frame
+// rate and ACKs per 100 frames with per frame and with cumulative ACKs at
+// each ACK loss rate, and the recovery time per lost frame and frame rate
+// with the timer alone and with NAKs at each frame loss rate. Returns the
+// report length.
+int frameRateBenchmark(char *report)
 {
-    if(Q->size==0)
+    static const int lossRates[SIMLOSSRATES] = {1, 10, 30};
+    gbnSim before, after;
+    int r, len = 0;
+
+    len += sprintf(report+len, "loss%% frames/s paced window\r\n");
+    for(r=0; r < SIMLOSSRATES; r++)
     {
-        printf("Queue is Empty\n");
-        exit(0);
+        before.lossPct = lossRates[r];
+        before.ackLossPct = 0;
+        before.gapMsec = PACEDGAPMS;
+        before.coalesce = 0;
+        before.nak = 0;
+        after = before;
+        after.gapMsec = TRANSMISSIONDELAY;
+        after.coalesce = FRAMEDELAY;
+        after.nak = 1;
+        srand(1);
+        gbnSimulate(&before);
+        srand(1);
+        gbnSimulate(&after);
+        len += sprintf(report+len, "%d %d %d\r\n", lossRates[r], 
+                before.framesPerSec, after.framesPerSec);
     }
-    else
+
+    len += sprintf(report+len, "ackloss%% frames/s per-frame cumulative "
+            "acks/100frames per-frame cumulative\r\n");
+    for(r=0; r < SIMLOSSRATES; r++)
+    {
+        before.lossPct = 0;
+        before.ackLossPct = lossRates[r];
+        before.gapMsec = TRANSMISSIONDELAY;
+        before.coalesce = 0;
+        before.nak = 0;
+        after = before;
+        after.coalesce = FRAMEDELAY;
+        srand(1);
+        gbnSimulate(&before);
+        srand(1);
+        gbnSimulate(&after);
+        len += sprintf(report+len, "%d %d %d %d %d\r\n", lossRates[r], 
+                before.framesPerSec, after.framesPerSec, before.acksPer100,
+                after.acksPer100);
+    }
+
+    len += sprintf(report+len, "loss%% recovery-ms timer nak "
+            "frames/s timer nak\r\n");
+    for(r=0; r < SIMLOSSRATES; r++)
+    {
+        before.lossPct = lossRates[r];
+        before.ackLossPct = 0;
+        before.gapMsec = TRANSMISSIONDELAY;
+        before.coalesce = FRAMEDELAY;
+        before.nak = 0;
+        after = before;
+        after.nak = 1;
+        srand(1);
+        gbnSimulate(&before);
+        srand(1);
+        gbnSimulate(&after);
+        len += sprintf(report+len, "%d %d %d %d %d\r\n", lossRates[r], 
+                before.recoveryMsec, after.recoveryMsec, before.framesPerSec,
+                after.framesPerSec);
+    }
+    return len;
+}
+
+// Handler of a timer of the timer benchmark. Notes how late it ran.
+void probeExpired(wheelTimer *timer)
+{
+    probeTimer *probe = (probeTimer *) timer;
+    probeStats *stats = timer->arg;
+    int late = (int)(ReadCoreTimer() - probe->deadline);
+
+    stats->fired++;
+    if (late < 0)
+    {
+        stats->early++;
+        return;
+    }
+    stats->lateSum += late;
+    if ((unsigned int)late > stats->lateMax) stats->lateMax = late;
+}
+
+// Starts TIMERPROBES timers on a wheel of its own and then services the
+// stack and the wheel as the main loop does until all of them ran out.
+// Appends the mean and worst lateness of the timers in usec, the number
+// that ran early, how often TCPIPProcess ran meanwhile and the longest
+// gap in usec between two of its runs. Returns the report length.
+int timerBenchmark(char *report)
+{
+    static probeTimer probe[TIMERPROBES];
+    probeStats stats = {0, 0, 0, 0};
+    timerWheel wheel;
+    unsigned int ticks, now, last, gap = 0;
+    int i, polls = 0;
+
+    srand(1);
+    wheelReset(&wheel);
+    for(i=0; i < TIMERPROBES; i++)
     {
-        Q->front = 0;
-        Q->rear = -1;
-        Q->size = 0;
+        ticks = (unsigned int) randMToN(0.0, TIMERSPANMSEC*TICKSPERMSEC);
+        timerInit(&probe[i].timer, probeExpired, &stats);
+        probe[i].deadline = ReadCoreTimer() + ticks;
+        timerStart(&wheel, &probe[i].timer, ticks);
     }
-    return;
-}
\ No newline at end of file
+
+    last = ReadCoreTimer();
+    while (stats.fired < TIMERPROBES)
+    {
+        TCPIPProcess();
+        DHCPTask();
+        polls++;
+        now = ReadCoreTimer();
+        if (now - last > gap) gap = now - last;
+        last = now;
+        wheelService(&wheel, now);
+    }
+
+    return sprintf(report, "timers late-us max-late-us early polls "
+            "max-gap-us\r\n%d %u %u %d %d %u\r\n", TIMERPROBES,
+            (unsigned int)(stats.lateSum/TIMERPROBES/(TICKSPERMSEC/1000)),
+            stats.lateMax/(TICKSPERMSEC/1000), stats.early, polls,
+            gap/(TICKSPERMSEC/1000));
+}
+
+// Runs the animation timer of led on wheel. Called once before the first
+// ledStart.
+void ledInit(ledAnimation *led, timerWheel *wheel)
+{
+    led->wheel = wheel;
+    timerInit(&led->timer, ledStep, led);
+}
+
+// Starts led over with pattern, cutting short any animation still showing
+void ledStart(ledAnimation *led, const unsigned int *pattern, 
+        int steps)
+{
+    if (timerPending(&led->timer)) mPORTDClearBits(led->pattern[led->step]);
+    led->pattern = pattern;
+    led->steps = steps;
+    led->step = 0;
+    mPORTDSetBits(pattern[0]);
+    timerStart(led->wheel, &led->timer, LEDSTEPMSEC*TICKSPERMSEC);
+}
+
+// Handler of the animation timer. Moves to the next step and clears the
+// LEDs after the last.
+void ledStep(wheelTimer *timer)
+{
+    ledAnimation *led = timer->arg;
+
+    mPORTDClearBits(led->pattern[led->step]);
+    led->step++;
+    if (led->step < led->steps)
+    {
+        mPORTDSetBits(led->pattern[led->step]);
+        timerStart(led->wheel, timer, LEDSTEPMSEC*TICKSPERMSEC);
+    }
+}